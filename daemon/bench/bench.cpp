@@ -0,0 +1,526 @@
+// Target deamon
+//
+// bench.cpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Loopback benchmark and load generator. Starts a daemon as a child process (or connects
+// to a running one) and runs repeatable scenarios against it, printing one JSON object
+// with percentiles per scenario.
+//
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+
+#include <CLI/CLI.hpp>
+
+#include "protocol.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+using asio::ip::tcp;
+using namespace std;
+
+namespace
+{
+    using clock_type = chrono::steady_clock;
+
+    struct client {
+        asio::io_context& io_context_;
+        tcp::socket socket_;
+        asio::streambuf buffer_;
+
+        client(asio::io_context& io_context, const tcp::endpoint& ep) : io_context_(io_context), socket_(io_context)
+        {
+            socket_.connect(ep);
+            socket_.set_option(tcp::no_delay(true));
+        }
+
+        void send(const string& s) { asio::write(socket_, asio::buffer(s)); }
+
+        // Reads lines until one starts with `key`, returns that line.
+        string read_until_line(const string& key)
+        {
+            for (;;) {
+                asio::read_until(socket_, buffer_, "\r\n");
+                istream is(&buffer_);
+                string line;
+                getline(is, line);
+                if (line.compare(0, key.size(), key) == 0)
+                    return line;
+                if (line.compare(0, 6, "ERROR=") == 0)
+                    throw runtime_error("Daemon replied " + line);
+            }
+        }
+
+        // Sends commands and waits for the reply of a trailing Q, which acknowledges all of them.
+        void send_and_sync(const string& cmds)
+        {
+            send(cmds + "Q\n");
+            read_until_line("POS=");
+        }
+    };
+
+    // Client of the binary protocol, negotiated on connect.
+    struct binary_client {
+        client client_;
+        protocol::binary::frame_parser parser_{false};
+        array<char, 4096> buffer_;
+        size_t replies_{};
+
+        binary_client(asio::io_context& io_context, const tcp::endpoint& ep) : client_(io_context, ep)
+        {
+            client_.send(string(protocol::binary::magic, sizeof protocol::binary::magic));
+            read_replies(1);  // Hello
+        }
+
+        // Appends a request frame to `out`.
+        static void add(string& out, protocol::binary::opcode op, uint32_t tag, const string& payload = string())
+        {
+            protocol::binary::encode(out, op, protocol::status::ok, tag, payload.data(), payload.size());
+        }
+
+        // Reads until `count` replies arrived, events are skipped.
+        void read_replies(size_t count)
+        {
+            replies_ = 0;
+            while (replies_ < count) {
+                auto length = client_.socket_.read_some(asio::buffer(buffer_));
+                parser_.feed(buffer_.data(), length, [this](const protocol::binary::header& h, protocol::slice) {
+                    if (h.opcode_ == protocol::binary::opcode::event)
+                        return;
+                    if (h.status_ != protocol::status::ok)
+                        throw runtime_error(string("Daemon replied ") + protocol::to_string(h.status_));
+                    ++replies_;
+                });
+            }
+        }
+    };
+
+    struct results {
+        string scenario_;
+        vector<double> samples_;  // In microseconds
+        string extra_;            // Additional JSON members
+
+        explicit results(string scenario) : scenario_(move(scenario)) {}
+
+        void add(clock_type::duration d) { samples_.push_back(chrono::duration<double, micro>(d).count()); }
+
+        double percentile(double p) const
+        {
+            if (samples_.empty())
+                return 0.0;
+            auto index = size_t(p * (samples_.size() - 1) + 0.5);
+            return samples_[index];
+        }
+
+        void print()
+        {
+            sort(samples_.begin(), samples_.end());
+            cout << "{\"scenario\":\"" << scenario_ << "\",\"count\":" << samples_.size()
+                 << ",\"p50_us\":" << percentile(0.50) << ",\"p90_us\":" << percentile(0.90)
+                 << ",\"p99_us\":" << percentile(0.99) << ",\"max_us\":" << (samples_.empty() ? 0.0 : samples_.back())
+                 << extra_ << "}" << endl;
+        }
+    };
+
+    string make_program(size_t steps, double delta)
+    {
+        stringstream ss;
+        ss << "C\n";
+        for (size_t i = 0; i < steps; ++i)
+            ss << "T" << delta << ";M" << (i & 1) << "\n";
+        return ss.str();
+    }
+
+    void bench_round_trip(asio::io_context& io_context, const tcp::endpoint& ep, const string& cmd, int iterations)
+    {
+        client c(io_context, ep);
+        results r{"round_trip_" + cmd};
+        const string key = (cmd == "Q") ? "POS=" : "OK";
+        for (int i = 0; i < iterations; ++i) {
+            auto line = (cmd == "D") ? "D" + to_string(i & 1) + "\n" : cmd + "\n";
+            auto t0   = clock_type::now();
+            c.send(line);
+            c.read_until_line(key);
+            r.add(clock_type::now() - t0);
+        }
+        r.print();
+    }
+
+    void bench_upload(asio::io_context& io_context, const tcp::endpoint& ep, size_t steps, int iterations)
+    {
+        client c(io_context, ep);
+        results r{"upload_" + to_string(steps) + "_steps"};
+        const auto program = make_program(steps, 0.5);
+        for (int i = 0; i < iterations; ++i) {
+            auto t0 = clock_type::now();
+            c.send_and_sync(program);
+            r.add(clock_type::now() - t0);
+        }
+        const double bytes = double(program.size());
+        stringstream extra;
+        extra << ",\"bytes\":" << program.size() << ",\"steps_per_s\":" << steps / (r.percentile(0.5) * 1e-6)
+              << ",\"mb_per_s\":" << bytes / r.percentile(0.5);
+        r.extra_ = extra.str();
+        r.print();
+    }
+
+    void bench_churn(asio::io_context& io_context, const tcp::endpoint& ep, int iterations)
+    {
+        results r{"connect_churn"};
+        for (int i = 0; i < iterations; ++i) {
+            auto t0 = clock_type::now();
+            {
+                client c(io_context, ep);
+                c.send("Q\n");
+                c.read_until_line("POS=");
+            }
+            r.add(clock_type::now() - t0);
+        }
+        r.print();
+    }
+
+    // Binary counterpart of bench_round_trip.
+    void bench_binary_round_trip(asio::io_context& io_context, const tcp::endpoint& ep, int iterations)
+    {
+        binary_client c(io_context, ep);
+        results r{"binary_round_trip_Q"};
+        string request;
+        for (int i = 0; i < iterations; ++i) {
+            request.clear();
+            binary_client::add(request, protocol::binary::opcode::query, uint32_t(i));
+            auto t0 = clock_type::now();
+            c.client_.send(request);
+            c.read_replies(1);
+            r.add(clock_type::now() - t0);
+        }
+        r.print();
+    }
+
+    // The program of make_program in frames, acknowledged by a trailing query.
+    string make_binary_program(size_t steps, uint32_t delta_ms)
+    {
+        string out;
+        binary_client::add(out, protocol::binary::opcode::clear, 0);
+        for (size_t i = 0; i < steps; ++i) {
+            string advance, move;
+            protocol::binary::put_u32(advance, delta_ms);
+            move.push_back(char(i & 1));
+            move.push_back('\0');
+            protocol::binary::put_u16(move, 0);
+            binary_client::add(out, protocol::binary::opcode::advance, uint32_t(i), advance);
+            binary_client::add(out, protocol::binary::opcode::add_move, uint32_t(i), move);
+        }
+        binary_client::add(out, protocol::binary::opcode::query, 0);
+        return out;
+    }
+
+    void bench_binary_upload(asio::io_context& io_context, const tcp::endpoint& ep, size_t steps, int iterations)
+    {
+        binary_client c(io_context, ep);
+        results r{"binary_upload_" + to_string(steps) + "_steps"};
+        const auto program = make_binary_program(steps, 500);
+        for (int i = 0; i < iterations; ++i) {
+            auto t0 = clock_type::now();
+            c.client_.send(program);
+            c.read_replies(2 * steps + 2);
+            r.add(clock_type::now() - t0);
+        }
+        stringstream extra;
+        extra << ",\"bytes\":" << program.size() << ",\"steps_per_s\":" << steps / (r.percentile(0.5) * 1e-6)
+              << ",\"mb_per_s\":" << program.size() / r.percentile(0.5);
+        r.extra_ = extra.str();
+        r.print();
+    }
+
+    // A request the program can't take fails alone: a wait that makes a repeated block too long
+    // is answered with Syntax, and the daemon goes on serving. Fails the benchmark if not.
+    void check_binary_overflow(asio::io_context& io_context, const tcp::endpoint& ep)
+    {
+        binary_client c(io_context, ep);
+        string request, count, ms;
+        protocol::binary::put_u32(count, 100000);
+        protocol::binary::put_u32(ms, 100000);
+        binary_client::add(request, protocol::binary::opcode::clear, 0);
+        binary_client::add(request, protocol::binary::opcode::repeat, 1, count);
+        binary_client::add(request, protocol::binary::opcode::advance, 2, ms);
+        binary_client::add(request, protocol::binary::opcode::query, 3);
+
+        results r{"binary_overflow"};
+        auto t0 = clock_type::now();
+        c.client_.send(request);
+        vector<protocol::status> statuses;
+        try {
+            while (statuses.size() < 4) {
+                auto length = c.client_.socket_.read_some(asio::buffer(c.buffer_));
+                c.parser_.feed(c.buffer_.data(), length, [&](const protocol::binary::header& h, protocol::slice) {
+                    if (h.opcode_ != protocol::binary::opcode::event)
+                        statuses.push_back(h.status_);
+                });
+            }
+        } catch (const exception&) {
+            throw runtime_error("Daemon closed the connection on an overflowing wait");
+        }
+        r.add(clock_type::now() - t0);
+        const vector<protocol::status> expected{
+            protocol::status::ok, protocol::status::ok, protocol::status::syntax, protocol::status::ok};
+        if (statuses != expected)
+            throw runtime_error("Overflowing wait not refused with Syntax");
+        r.print();
+    }
+
+    // Encoding and splitting of both protocols in process, without the daemon or the network.
+    // Each sample encodes a program of `steps` steps and feeds it through the daemon's parser
+    // in reads of the daemon's buffer size.
+    void bench_codec(size_t steps, int iterations)
+    {
+        const size_t read_size = 1024;
+        results text{"codec_text_" + to_string(steps) + "_steps"};
+        results binary{"codec_binary_" + to_string(steps) + "_steps"};
+        size_t text_bytes = 0, binary_bytes = 0, commands = 0;
+
+        for (int i = 0; i < iterations; ++i) {
+            auto t0     = clock_type::now();
+            auto stream = make_program(steps, 0.5);
+            protocol::command_parser parser(1024);
+            commands = 0;
+            for (size_t pos = 0; pos < stream.size(); pos += read_size) {
+                parser.feed(stream.data() + pos,
+                            min(read_size, stream.size() - pos),
+                            [&](protocol::slice cmd) { commands += cmd.size() != 0; },
+                            [] {});
+            }
+            text.add(clock_type::now() - t0);
+            text_bytes = stream.size();
+
+            t0 = clock_type::now();
+            stream.assign(protocol::binary::magic, sizeof protocol::binary::magic);
+            stream += make_binary_program(steps, 500);
+            protocol::binary::frame_parser frames;
+            commands = 0;
+            for (size_t pos = 0; pos < stream.size(); pos += read_size) {
+                frames.feed(stream.data() + pos,
+                            min(read_size, stream.size() - pos),
+                            [&](const protocol::binary::header&, protocol::slice) { ++commands; });
+            }
+            binary.add(clock_type::now() - t0);
+            binary_bytes = stream.size();
+        }
+
+        for (auto r : {&text, &binary}) {
+            const auto bytes = r == &text ? text_bytes : binary_bytes;
+            stringstream extra;
+            extra << ",\"bytes\":" << bytes << ",\"steps_per_s\":" << steps / (r->percentile(0.5) * 1e-6)
+                  << ",\"mb_per_s\":" << bytes / r->percentile(0.5);
+            r->extra_ = extra.str();
+            r->print();
+        }
+    }
+
+    // Time from sending R to receiving the first step's event, with and without arming the
+    // program first, together with the daemon's own command to first step histogram.
+    void bench_start(asio::io_context& io_context, const tcp::endpoint& ep, bool armed, int iterations)
+    {
+        client c(io_context, ep);
+        c.send_and_sync("C\nT0;M1\nT0.01;M0\n");
+        c.send("H\n");
+        c.read_until_line("START=");  // Reset histograms
+
+        results r{armed ? "start_armed" : "start_unarmed"};
+        c.send("E1\n");
+        c.read_until_line("OK");
+        for (int i = 0; i < iterations; ++i) {
+            if (armed) {
+                c.send("V\n");
+                c.read_until_line("ARMED=");
+            }
+            auto t0 = clock_type::now();
+            c.send("R\n");
+            c.read_until_line("EVENT=STEP,0,");
+            r.add(clock_type::now() - t0);
+            c.read_until_line("EVENT=ENDED");
+        }
+        c.send("E0\nH\n");
+        auto start = c.read_until_line("START=");
+        r.extra_   = ",\"daemon_histogram\":\"" + start.substr(6, start.find('\r') - 6) + "\"";
+        r.print();
+    }
+
+    // Runs a program with `steps` steps `delta` seconds apart and reports the daemon's own
+    // lateness histogram together with the lateness seen in the step events.
+    void bench_jitter(asio::io_context& io_context, const tcp::endpoint& ep, size_t steps, double delta)
+    {
+        client c(io_context, ep);
+        c.send_and_sync(make_program(steps, delta));
+        c.send("H\n");
+        c.read_until_line("AUDIO=");  // Reset histograms
+
+        results r{"step_jitter_" + to_string(steps) + "x" + to_string(int(delta * 1000)) + "ms"};
+        c.send("E1\nR\n");
+        for (;;) {
+            auto line = c.read_until_line("EVENT=");
+            if (line.compare(0, 11, "EVENT=ENDED") == 0)
+                break;
+            if (line.compare(0, 11, "EVENT=STEP,") != 0)
+                continue;
+            double scheduled = 0, actual = 0;
+            size_t index     = 0;
+            char sep;
+            istringstream is(line.substr(11));
+            is >> index >> sep >> scheduled >> sep >> actual;
+            r.samples_.push_back((actual - scheduled) * 1e6);
+        }
+        c.send("E0\nH\n");
+        auto step = c.read_until_line("STEP=");
+        r.extra_  = ",\"daemon_histogram\":\"" + step.substr(5, step.find('\r') - 5) + "\"";
+        r.print();
+    }
+
+#ifndef _WIN32
+    struct child_daemon {
+        pid_t pid_{-1};
+
+        child_daemon(const string& path, int port, int timeout = 0)
+        {
+            const auto port_arg    = to_string(port);
+            const auto timeout_arg = to_string(timeout);
+            const char* argv[]     = {path.c_str(),
+                                  "--port",
+                                  port_arg.c_str(),
+                                  "--audio-sink",
+                                  "null",
+                                  "--timeout",
+                                  timeout_arg.c_str(),
+                                  nullptr};
+            // The daemon logs every step, keep that out of the results
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+            int err = posix_spawn(&pid_, path.c_str(), &actions, nullptr, const_cast<char**>(argv), environ);
+            posix_spawn_file_actions_destroy(&actions);
+            if (err != 0)
+                throw runtime_error("Can't start daemon '" + path + "'");
+        }
+
+        ~child_daemon()
+        {
+            kill(pid_, SIGTERM);
+            waitpid(pid_, nullptr, 0);
+        }
+    };
+#endif
+
+    // Waits for the daemon to accept connections.
+    void wait_for_daemon(asio::io_context& io_context, const tcp::endpoint& ep)
+    {
+        auto deadline = clock_type::now() + chrono::seconds(5);
+        for (;;) {
+            try {
+                client c(io_context, ep);
+                return;
+            } catch (const exception&) {
+                if (clock_type::now() > deadline)
+                    throw runtime_error("Daemon not reachable");
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+        }
+    }
+
+#ifndef _WIN32
+    // A client that only listens to events must outlive the idle timeout. Starts a daemon
+    // with a 1 s timeout on `port`, subscribes and stays silent for 3 s, then checks the
+    // session still answers. Fails the benchmark if it was closed.
+    void check_idle_subscriber(asio::io_context& io_context, const string& daemon_path, int port)
+    {
+        child_daemon child(daemon_path, port, 1);
+        tcp::endpoint ep(asio::ip::make_address("127.0.0.1"), static_cast<unsigned short>(port));
+        wait_for_daemon(io_context, ep);
+
+        client c(io_context, ep);
+        c.send("E1\n");
+        c.read_until_line("OK");
+        this_thread::sleep_for(chrono::seconds(3));
+
+        results r{"idle_subscriber"};
+        auto t0 = clock_type::now();
+        try {
+            c.send("Q\n");
+            c.read_until_line("POS=");
+        } catch (const exception&) {
+            throw runtime_error("Idle subscriber was closed by the watchdog");
+        }
+        r.add(clock_type::now() - t0);
+        r.print();
+    }
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+    CLI::App app{"Target daemon benchmark"};
+
+    try {
+        string daemon_path = "./target_daemon";
+        string host;
+        int port       = 7787;
+        int iterations = 1000;
+        size_t steps   = 500;
+
+        app.add_option("--daemon", daemon_path, "Daemon executable to start, default is './target_daemon'");
+        app.add_option("--connect", host, "Benchmark an already running daemon on this host instead");
+        app.add_option("--port", port, "Port of the daemon, default is 7787");
+        app.add_option("--iterations", iterations, "Iterations of the round trip and churn scenarios", true);
+        app.add_option("--steps", steps, "Number of steps in the upload and jitter programs", true);
+
+        CLI11_PARSE(app, argc, argv);
+
+        asio::io_context io_context;
+        tcp::endpoint ep(asio::ip::make_address(host.empty() ? "127.0.0.1" : host), static_cast<unsigned short>(port));
+
+#ifndef _WIN32
+        unique_ptr<child_daemon> child;
+        if (host.empty())
+            child.reset(new child_daemon(daemon_path, port));
+#else
+        if (host.empty())
+            throw runtime_error("Use --connect to benchmark a running daemon");
+#endif
+        wait_for_daemon(io_context, ep);
+
+        bench_round_trip(io_context, ep, "Q", iterations);
+        bench_round_trip(io_context, ep, "D", iterations);
+        bench_upload(io_context, ep, 10, 100);
+        bench_upload(io_context, ep, steps, 100);
+        bench_binary_round_trip(io_context, ep, iterations);
+        bench_binary_upload(io_context, ep, 10, 100);
+        bench_binary_upload(io_context, ep, steps, 100);
+        bench_codec(steps, 100);
+        bench_churn(io_context, ep, iterations);
+        bench_start(io_context, ep, false, 200);
+        bench_start(io_context, ep, true, 200);
+        bench_jitter(io_context, ep, steps, 0.01);
+        check_binary_overflow(io_context, ep);
+#ifndef _WIN32
+        if (host.empty())
+            check_idle_subscriber(io_context, daemon_path, port + 1);
+#endif
+    } catch (exception& e) {
+        cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,433 @@
+#include "audio.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    const size_t period_frames = 256;
+
+    uint16_t read_u16(const uint8_t* p) { return uint16_t(p[0] | (p[1] << 8)); }
+    uint32_t read_u32(const uint8_t* p) { return uint32_t(p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24)); }
+
+    void write_u16(ostream& os, uint16_t v)
+    {
+        const char b[] = {char(v & 0xff), char(v >> 8)};
+        os.write(b, sizeof b);
+    }
+
+    void write_u32(ostream& os, uint32_t v)
+    {
+        const char b[] = {char(v & 0xff), char((v >> 8) & 0xff), char((v >> 16) & 0xff), char(v >> 24)};
+        os.write(b, sizeof b);
+    }
+
+    // Discards or stores audio but blocks like a real device would.
+    struct paced_sink : audio::sink {
+        audio::format format_;
+        chrono::steady_clock::time_point start_{chrono::steady_clock::now()};
+        uint64_t frames_written_{};
+
+        audio::format stream_format() const override { return format_; }
+
+        void write(const int16_t* interleaved, size_t frames) override
+        {
+            consume(interleaved, frames);
+            frames_written_ += frames;
+            auto due = start_ + chrono::microseconds(frames_written_ * 1000000 / format_.rate);
+            // Keep at most one period queued, like a small device buffer
+            this_thread::sleep_until(due - chrono::microseconds(period_frames * 1000000 / format_.rate));
+        }
+
+        chrono::microseconds latency() const override
+        {
+            return chrono::microseconds(period_frames * 1000000 / format_.rate);
+        }
+
+        virtual void consume(const int16_t*, size_t) {}
+    };
+
+    struct null_sink : paced_sink {
+    };
+
+    struct file_sink : paced_sink {
+        ofstream file_;
+        uint32_t data_bytes_{};
+
+        explicit file_sink(const string& path) : file_(path, ios::binary)
+        {
+            if (!file_)
+                throw runtime_error("Can't open audio output file '" + path + "'");
+            write_header();
+        }
+
+        ~file_sink()
+        {
+            file_.seekp(0);
+            write_header();
+        }
+
+        void write_header()
+        {
+            const uint16_t block_align = uint16_t(format_.channels * sizeof(int16_t));
+            file_.write("RIFF", 4);
+            write_u32(file_, 36 + data_bytes_);
+            file_.write("WAVEfmt ", 8);
+            write_u32(file_, 16);
+            write_u16(file_, 1);
+            write_u16(file_, uint16_t(format_.channels));
+            write_u32(file_, format_.rate);
+            write_u32(file_, format_.rate * block_align);
+            write_u16(file_, block_align);
+            write_u16(file_, 16);
+            file_.write("data", 4);
+            write_u32(file_, data_bytes_);
+        }
+
+        void consume(const int16_t* interleaved, size_t frames) override
+        {
+            // Samples are stored little endian, as on the targets we run on
+            const auto bytes = frames * format_.channels * sizeof(int16_t);
+            file_.write(reinterpret_cast<const char*>(interleaved), bytes);
+            data_bytes_ += uint32_t(bytes);
+        }
+    };
+
+#if HAVE_ALSA
+    struct alsa_sink : audio::sink {
+        snd_pcm_t* pcm_{};
+        audio::format format_;
+        chrono::microseconds latency_{};
+
+        explicit alsa_sink(const string& device)
+        {
+            int err = snd_pcm_open(&pcm_, device.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+            if (err < 0)
+                throw runtime_error("ALSA: " + string(snd_strerror(err)));
+            // Small buffer, triggered clips should be heard as soon as possible
+            err = snd_pcm_set_params(
+                pcm_, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, format_.channels, format_.rate, 1, 20000);
+            if (err < 0) {
+                snd_pcm_close(pcm_);
+                throw runtime_error("ALSA: " + string(snd_strerror(err)));
+            }
+            snd_pcm_uframes_t buffer_size = 0, period_size = 0;
+            snd_pcm_get_params(pcm_, &buffer_size, &period_size);
+            latency_ = chrono::microseconds(uint64_t(buffer_size) * 1000000 / format_.rate);
+        }
+
+        ~alsa_sink()
+        {
+            snd_pcm_drain(pcm_);
+            snd_pcm_close(pcm_);
+        }
+
+        audio::format stream_format() const override { return format_; }
+
+        void write(const int16_t* interleaved, size_t frames) override
+        {
+            while (frames > 0) {
+                auto n = snd_pcm_writei(pcm_, interleaved, frames);
+                if (n < 0) {
+                    if (snd_pcm_recover(pcm_, int(n), 1) < 0)
+                        return;
+                    continue;
+                }
+                frames -= size_t(n);
+                interleaved += size_t(n) * format_.channels;
+            }
+        }
+
+        chrono::microseconds latency() const override { return latency_; }
+    };
+#endif
+
+    // Converts one sample of any supported PCM format to 16 bit.
+    int16_t decode_sample(const uint8_t* p, unsigned bits, bool is_float)
+    {
+        if (is_float) {
+            float f;
+            memcpy(&f, p, sizeof f);
+            return int16_t(max(-1.0f, min(1.0f, f)) * 32767.0f);
+        }
+        switch (bits) {
+        case 8:
+            return int16_t((int(p[0]) - 128) << 8);
+        case 16:
+            return int16_t(read_u16(p));
+        case 24:
+            return int16_t(read_u16(p + 1));
+        case 32:
+            return int16_t(read_u16(p + 2));
+        }
+        return 0;
+    }
+}
+
+namespace audio
+{
+    shared_ptr<const clip> clip::load(const string& path)
+    {
+        shared_ptr<clip> c(new clip());
+
+        const uint8_t* data = nullptr;
+        size_t size         = 0;
+        vector<uint8_t> file_data;
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 44) {
+            close(fd);
+            return nullptr;
+        }
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;  // Fault in all pages now rather than during playback
+#endif
+        void* mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, flags, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+        c->mapping_      = mapping;
+        c->mapping_size_ = size_t(st.st_size);
+        data             = static_cast<const uint8_t*>(mapping);
+        size             = c->mapping_size_;
+#else
+        ifstream file(path, ios::binary);
+        if (!file)
+            return nullptr;
+        file_data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        data = file_data.data();
+        size = file_data.size();
+#endif
+
+        if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0)
+            return nullptr;
+
+        unsigned format_tag = 0, bits = 0;
+        const uint8_t* pcm  = nullptr;
+        size_t pcm_bytes    = 0;
+        size_t offset       = 12;
+        while (offset + 8 <= size) {
+            const uint8_t* chunk = data + offset;
+            size_t chunk_size    = read_u32(chunk + 4);
+            size_t available     = min(chunk_size, size - offset - 8);
+            if (memcmp(chunk, "fmt ", 4) == 0 && available >= 16) {
+                format_tag   = read_u16(chunk + 8);
+                c->channels_ = read_u16(chunk + 10);
+                c->rate_     = read_u32(chunk + 12);
+                bits         = read_u16(chunk + 22);
+                if (format_tag == 0xFFFE && available >= 26)  // WAVE_FORMAT_EXTENSIBLE, use sub format
+                    format_tag = read_u16(chunk + 32);
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                pcm       = chunk + 8;
+                pcm_bytes = available;
+            }
+            offset += 8 + chunk_size + (chunk_size & 1);
+        }
+
+        const bool is_float = (format_tag == 3 && bits == 32);
+        if (!pcm || c->channels_ == 0 || c->rate_ == 0 || !(format_tag == 1 || is_float))
+            return nullptr;
+        if (bits != 8 && bits != 16 && bits != 24 && bits != 32)
+            return nullptr;
+
+        const size_t frame_bytes = c->channels_ * bits / 8;
+        c->frames_               = pcm_bytes / frame_bytes;
+
+#ifndef _WIN32
+        if (bits == 16 && !is_float && (reinterpret_cast<uintptr_t>(pcm) & 1) == 0) {
+            c->samples_ = reinterpret_cast<const int16_t*>(pcm);
+            return c;
+        }
+#endif
+        c->decoded_.resize(c->frames_ * c->channels_);
+        for (size_t i = 0; i < c->decoded_.size(); ++i)
+            c->decoded_[i] = decode_sample(pcm + i * bits / 8, bits, is_float);
+        c->samples_ = c->decoded_.data();
+#ifndef _WIN32
+        // All data is decoded, the mapping is no longer needed
+        munmap(c->mapping_, c->mapping_size_);
+        c->mapping_ = nullptr;
+#endif
+        return c;
+    }
+
+    clip::~clip()
+    {
+#ifndef _WIN32
+        if (mapping_)
+            munmap(mapping_, mapping_size_);
+#endif
+    }
+
+    unique_ptr<sink> make_sink(const string& spec)
+    {
+        auto colon  = spec.find(':');
+        auto type   = spec.substr(0, colon);
+        string args = (colon != string::npos) ? spec.substr(colon + 1) : string{};
+
+        if (type == "null")
+            return unique_ptr<sink>(new null_sink());
+        if (type == "file") {
+            if (args.empty())
+                throw runtime_error("Audio sink 'file' needs a path");
+            return unique_ptr<sink>(new file_sink(args));
+        }
+        if (type == "alsa") {
+#if HAVE_ALSA
+            return unique_ptr<sink>(new alsa_sink(args.empty() ? "default" : args));
+#else
+            throw runtime_error("ALSA support not compiled in");
+#endif
+        }
+        throw runtime_error("Unknown audio sink '" + spec + "'");
+    }
+
+    engine::engine(unique_ptr<sink> output, metrics::histogram* trigger_latency)
+        : sink_(move(output)), format_(sink_->stream_format()), trigger_latency_(trigger_latency)
+    {
+        thread_ = thread([this] { run(); });
+    }
+
+    engine::~engine()
+    {
+        stop_ = true;
+        thread_.join();
+    }
+
+    shared_ptr<const clip> engine::get_clip(const string& path)
+    {
+        lock_guard<mutex> lock(cache_mutex_);
+        auto it = cache_.find(path);
+        if (it != cache_.end())
+            return it->second;
+        auto c = clip::load(path);
+        if (c)
+            cache_[path] = c;
+        return c;
+    }
+
+    bool engine::preload(const string& path) { return !!get_clip(path); }
+
+    bool engine::play(const string& path) { return start(path, false); }
+
+    bool engine::measure(const string& path)
+    {
+        measurement_us_ = 0;
+        return start(path, true);
+    }
+
+    bool engine::start(const string& path, bool probe)
+    {
+        auto c = get_clip(path);
+        if (!c)
+            return false;
+        voice v;
+        v.clip_   = move(c);
+        v.step_   = double(v.clip_->rate()) / format_.rate;
+        v.queued_ = chrono::steady_clock::now();
+        v.probe_  = probe;
+        lock_guard<mutex> lock(pending_mutex_);
+        pending_.push_back(move(v));
+        return true;
+    }
+
+    void engine::mix(int32_t* accum, size_t frames, voice& v, bool& finished) const
+    {
+        const auto& c        = *v.clip_;
+        const auto channels  = c.channels();
+        const auto* samples  = c.samples();
+        const size_t last    = c.frames() - 1;
+        const bool resample  = (v.step_ != 1.0);
+        for (size_t f = 0; f < frames; ++f) {
+            const size_t index = size_t(v.position_);
+            if (index >= c.frames()) {
+                finished = true;
+                return;
+            }
+            const double frac   = v.position_ - index;
+            const size_t next   = min(index + 1, last);
+            for (unsigned ch = 0; ch < format_.channels; ++ch) {
+                const unsigned src = min(ch, channels - 1);
+                int32_t s          = samples[index * channels + src];
+                if (resample)
+                    s += int32_t((samples[next * channels + src] - s) * frac);
+                accum[f * format_.channels + ch] += s;
+            }
+            v.position_ += v.step_;
+        }
+        finished = size_t(v.position_) >= c.frames();
+    }
+
+    void engine::run()
+    {
+        vector<voice> active;
+        vector<voice> incoming;
+        vector<int32_t> accum(period_frames * format_.channels);
+        vector<int32_t> probe(period_frames * format_.channels);
+        vector<int16_t> out(period_frames * format_.channels);
+
+        // The stream is kept running with silence so a trigger is only delayed by the sink buffer
+        while (!stop_) {
+            {
+                lock_guard<mutex> lock(pending_mutex_);
+                incoming.swap(pending_);
+            }
+            for (auto& v : incoming) {
+                if (trigger_latency_)
+                    trigger_latency_->record(chrono::steady_clock::now() - v.queued_ + sink_->latency());
+                active.push_back(move(v));
+            }
+            incoming.clear();
+
+            fill(accum.begin(), accum.end(), 0);
+            const auto now = chrono::steady_clock::now();
+            for (auto it = active.begin(); it != active.end();) {
+                bool finished = false;
+                if (!it->probe_)
+                    mix(accum.data(), period_frames, *it, finished);
+                else {
+                    // Mixed on its own to find the first audible frame, which is heard after
+                    // the sink latency once this period is written
+                    fill(probe.begin(), probe.end(), 0);
+                    mix(probe.data(), period_frames, *it, finished);
+                    auto first = find_if(probe.begin(), probe.end(), [](int32_t s) { return s != 0; });
+                    if (first != probe.end()) {
+                        auto frame = uint64_t(first - probe.begin()) / format_.channels;
+                        auto onset = chrono::duration_cast<chrono::microseconds>(now - it->queued_) +
+                                     chrono::microseconds(frame * 1000000 / format_.rate) + sink_->latency();
+                        measurement_us_.store(max<int64_t>(onset.count(), 1), memory_order_release);
+                        it->probe_ = false;
+                    } else if (finished)
+                        measurement_us_.store(-1, memory_order_release);
+                    for (size_t i = 0; i < accum.size(); ++i)
+                        accum[i] += probe[i];
+                }
+                it = finished ? active.erase(it) : it + 1;
+            }
+            for (size_t i = 0; i < accum.size(); ++i)
+                out[i] = int16_t(max(-32768, min(32767, accum[i])));
+
+            sink_->write(out.data(), period_frames);
+        }
+    }
+}
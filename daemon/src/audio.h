@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+namespace audio
+{
+    // Format of the output stream, clips are converted to this when mixed.
+    struct format {
+        unsigned rate     = 48000;
+        unsigned channels = 2;
+    };
+
+    // A WAV file loaded once. 16 bit PCM data is used straight from the memory mapping,
+    // other sample formats are decoded to 16 bit at load time.
+    struct clip {
+        static std::shared_ptr<const clip> load(const std::string& path);
+        ~clip();
+
+        const int16_t* samples() const { return samples_; }
+        size_t frames() const { return frames_; }
+        unsigned rate() const { return rate_; }
+        unsigned channels() const { return channels_; }
+
+    private:
+        clip() = default;
+        clip(const clip&) = delete;
+        clip& operator=(const clip&) = delete;
+
+        void* mapping_{};
+        size_t mapping_size_{};
+        std::vector<int16_t> decoded_;
+        const int16_t* samples_{};
+        size_t frames_{};
+        unsigned rate_{};
+        unsigned channels_{};
+    };
+
+    // Output stream, write() blocks until the device accepts the frames.
+    struct sink {
+        virtual ~sink() = default;
+        virtual format stream_format() const = 0;
+        virtual void write(const int16_t* interleaved, size_t frames) = 0;
+        // Time between handing a frame to write() and it becoming audible.
+        virtual std::chrono::microseconds latency() const { return std::chrono::microseconds::zero(); }
+    };
+
+    // Creates a sink from its command line description:
+    //   alsa[:<device>]  ALSA playback device (default "default")
+    //   null             Discards audio, paced in real time
+    //   file:<path>      Writes the mixed stream to a WAV file, paced in real time
+    std::unique_ptr<sink> make_sink(const std::string& spec);
+
+    // Keeps the sink open and mixes all triggered clips on a single thread.
+    struct engine {
+        // If given, `trigger_latency` records the time from play() until the clip is audible.
+        explicit engine(std::unique_ptr<sink> output, metrics::histogram* trigger_latency = nullptr);
+        ~engine();
+
+        // Loads and caches the clip, returns false if the file can't be used.
+        bool preload(const std::string& path);
+        // Starts playing the clip, overlapping clips are mixed. Returns false if the
+        // clip can't be loaded.
+        bool play(const std::string& path);
+        // Plays the clip and measures the time until its first non-silent sample is audible:
+        // the trigger delay, any leading silence of the file and the sink latency, as a
+        // loopback of the output would see it. The result is read with measurement().
+        bool measure(const std::string& path);
+        // Result of the latest measure(): zero while it runs, negative if the clip was silent.
+        std::chrono::microseconds measurement() const
+        {
+            return std::chrono::microseconds(measurement_us_.load(std::memory_order_acquire));
+        }
+
+        std::chrono::microseconds latency() const { return sink_->latency(); }
+
+    private:
+        struct voice {
+            std::shared_ptr<const clip> clip_;
+            double position_{};  // In source frames
+            double step_{};      // Source frames per output frame
+            std::chrono::steady_clock::time_point queued_;
+            bool probe_{};  // Started by measure(), its onset is timed
+        };
+
+        std::shared_ptr<const clip> get_clip(const std::string& path);
+        bool start(const std::string& path, bool probe);
+        void run();
+        void mix(int32_t* accum, size_t frames, voice& v, bool& finished) const;
+
+        std::unique_ptr<sink> sink_;
+        const format format_;
+        metrics::histogram* trigger_latency_;
+
+        std::mutex cache_mutex_;
+        std::map<std::string, std::shared_ptr<const clip>> cache_;
+
+        std::mutex pending_mutex_;
+        std::vector<voice> pending_;
+
+        std::atomic<int64_t> measurement_us_{0};
+        std::atomic<bool> stop_{false};
+        std::thread thread_;
+    };
+}
@@ -0,0 +1,127 @@
+#include "gpio.h"
+
+#include <stdexcept>
+
+#if RASPBERRY_PI
+#include <pigpio.h>
+#endif
+
+using namespace std;
+
+#if RASPBERRY_PI
+gpio_init_handler::gpio_init_handler()
+{
+    if (++instances_ == 1) {
+        if (gpioInitialise() < 0)
+            throw runtime_error("GPIO not available!!");
+        gpioSetMode(GPIO::TURN_FRONT, PI_OUTPUT);
+        gpioSetMode(GPIO::TURN_AWAY, PI_OUTPUT);
+        gpioSetMode(GPIO::ENABLE, PI_OUTPUT);
+        gpioSetMode(GPIO::SERVER_READY, PI_OUTPUT);
+        gpioSetMode(GPIO::SESSION_ACTIVE, PI_OUTPUT);
+        gpioSetMode(GPIO::PROGRAM_ACTIVE, PI_OUTPUT);
+        gpioSetMode(GPIO::BUTTON, PI_INPUT);
+        // 20 ms glitch filter on button
+        gpioGlitchFilter(GPIO::BUTTON, 20000);
+    }
+}
+
+gpio_init_handler::~gpio_init_handler()
+{
+    if (--instances_ == 0) {
+        gpioTerminate();
+    }
+}
+
+atomic<int> gpio_init_handler::instances_{0};
+#endif
+
+namespace gpio
+{
+    vector<lane_pins> parse_lanes(const string& s)
+    {
+        vector<lane_pins> lanes;
+        size_t pos = 0;
+        while (pos < s.size()) {
+            auto end = s.find(',', pos);
+            if (end == string::npos)
+                end = s.size();
+            auto pair  = s.substr(pos, end - pos);
+            auto colon = pair.find(':');
+            if (colon == string::npos)
+                throw runtime_error("Lane '" + pair + "' is not <front>:<away>");
+            lane_pins lane{unsigned(stoul(pair.substr(0, colon))), unsigned(stoul(pair.substr(colon + 1)))};
+            if (lane.front_ > 31 || lane.away_ > 31 || lane.front_ == lane.away_)
+                throw runtime_error("Lane '" + pair + "' has invalid pins");
+            lanes.push_back(lane);
+            pos = end + 1;
+        }
+        if (lanes.empty() || lanes.size() > max_lanes)
+            throw runtime_error("Between 1 and " + to_string(int(max_lanes)) + " lanes must be given");
+        return lanes;
+    }
+
+    void simulated_backend::write_masks(uint32_t set, uint32_t clear)
+    {
+        const auto old = bank_;
+        bank_          = (bank_ & ~clear) | set;
+        if (!on_write_)
+            return;
+        for (unsigned pin = 0; pin < 32; ++pin) {
+            if (((old ^ bank_) >> pin) & 1)
+                on_write_(pin, (bank_ >> pin) & 1);
+        }
+    }
+
+#if RASPBERRY_PI
+    pigpio_backend::~pigpio_backend()
+    {
+        gpioWaveTxStop();
+        for (const auto& w : waves_)
+            gpioWaveDelete(unsigned(w.second));
+    }
+
+    void pigpio_backend::configure_output(unsigned pin) { gpioSetMode(pin, PI_OUTPUT); }
+
+    void pigpio_backend::write_masks(uint32_t set, uint32_t clear)
+    {
+        if (clear)
+            gpioWrite_Bits_0_31_Clear(clear);
+        if (set)
+            gpioWrite_Bits_0_31_Set(set);
+    }
+
+    uint32_t pigpio_backend::read_bank() const { return gpioRead_Bits_0_31(); }
+
+    bool pigpio_backend::start_pulse(uint32_t mask, chrono::microseconds width)
+    {
+        // Waves are created once per mask and width and then reused
+        auto key = make_pair(mask, (long long)width.count());
+        auto it  = waves_.find(key);
+        if (it == waves_.end()) {
+            gpioPulse_t pulses[] = {
+                {mask, 0, uint32_t(width.count())},
+                {0, mask, 0},
+            };
+            gpioWaveAddNew();
+            gpioWaveAddGeneric(2, pulses);
+            int wave = gpioWaveCreate();
+            if (wave < 0)
+                return false;
+            it = waves_.emplace(key, wave).first;
+        }
+        return gpioWaveTxSend(unsigned(it->second), PI_WAVE_MODE_ONE_SHOT) >= 0;
+    }
+
+    void pigpio_backend::stop_pulse() { gpioWaveTxStop(); }
+#endif
+
+    unique_ptr<backend> make_backend()
+    {
+#if RASPBERRY_PI
+        return unique_ptr<backend>(new pigpio_backend());
+#else
+        return unique_ptr<backend>(new simulated_backend());
+#endif
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum GPIO {              // GPIO pin
+    ENABLE         = 0,  // 11
+    TURN_FRONT     = 2,  // 13
+    TURN_AWAY      = 3,  // 15
+    SERVER_READY   = 1,  // 12
+    SESSION_ACTIVE = 4,  // 16
+    PROGRAM_ACTIVE = 5,  // 18
+    BUTTON         = 6,  // 22 (input active low)
+};
+
+#if RASPBERRY_PI
+// Initialises pigpio while at least one instance exists.
+struct gpio_init_handler {
+    gpio_init_handler();
+    ~gpio_init_handler();
+
+private:
+    static std::atomic<int> instances_;
+};
+#else
+struct gpio_init_handler {
+};
+#endif
+
+namespace gpio
+{
+    // Pins turning the target of one lane.
+    struct lane_pins {
+        unsigned front_;
+        unsigned away_;
+    };
+
+    enum { max_lanes = 16 };
+
+    // Parses "<front>:<away>[,<front>:<away>...]", one pair of pin numbers per lane.
+    std::vector<lane_pins> parse_lanes(const std::string& s);
+
+    // Access to the output pins, so target control runs the same on the Pi and elsewhere.
+    // Pins are addressed as bit masks of GPIO 0-31, all pins of a mask change in the same
+    // register write.
+    struct backend {
+        virtual ~backend() = default;
+
+        virtual void configure_output(unsigned pin) = 0;
+        virtual void write_masks(uint32_t set, uint32_t clear) = 0;
+        virtual uint32_t read_bank() const = 0;
+
+        void write(unsigned pin, bool level) { level ? write_masks(1u << pin, 0) : write_masks(0, 1u << pin); }
+        bool read(unsigned pin) const { return (read_bank() >> pin) & 1; }
+
+        // Starts a pulse of `width` on all pins in `mask`, timed by the backend itself.
+        // Returns false if the backend can't, the caller then has to time the pulse.
+        virtual bool start_pulse(uint32_t /*mask*/, std::chrono::microseconds /*width*/) { return false; }
+        // Stops a pulse in progress. The caller clears the pins.
+        virtual void stop_pulse() {}
+    };
+
+    // Keeps pin levels in memory. Used when not running on the Pi.
+    struct simulated_backend : backend {
+        typedef std::function<void(unsigned pin, bool level)> on_write_type;
+        on_write_type on_write_;  // Optional trace of every pin change
+
+        void configure_output(unsigned) override {}
+        void write_masks(uint32_t set, uint32_t clear) override;
+        uint32_t read_bank() const override { return bank_; }
+
+    private:
+        uint32_t bank_{};
+    };
+
+#if RASPBERRY_PI
+    // pigpio, pulses are generated as DMA timed waveforms for microsecond accuracy.
+    struct pigpio_backend : backend, gpio_init_handler {
+        ~pigpio_backend();
+
+        void configure_output(unsigned pin) override;
+        void write_masks(uint32_t set, uint32_t clear) override;
+        uint32_t read_bank() const override;
+        bool start_pulse(uint32_t mask, std::chrono::microseconds width) override;
+        void stop_pulse() override;
+
+    private:
+        std::map<std::pair<uint32_t, long long>, int> waves_;  // (mask, width) -> wave id
+    };
+#endif
+
+    // pigpio on the Pi, simulated elsewhere.
+    std::unique_ptr<backend> make_backend();
+}
@@ -0,0 +1,166 @@
+#include "http.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+    bool equals_nocase(const char* a, size_t a_len, const char* b)
+    {
+        if (a_len != strlen(b))
+            return false;
+        for (size_t i = 0; i < a_len; ++i) {
+            if (tolower(uint8_t(a[i])) != tolower(uint8_t(b[i])))
+                return false;
+        }
+        return true;
+    }
+
+    bool contains_nocase(const string& value, const char* word)
+    {
+        size_t len = strlen(word);
+        for (size_t i = 0; i + len <= value.size(); ++i) {
+            if (equals_nocase(value.data() + i, len, word))
+                return true;
+        }
+        return false;
+    }
+}
+
+namespace http
+{
+    int request_parser::parse(const char* data, size_t size, request& r, size_t& used)
+    {
+        used = 0;
+        // Empty lines before a request are allowed
+        size_t start = 0;
+        while (start + 1 < size && data[start] == '\r' && data[start + 1] == '\n')
+            start += 2;
+
+        const char* head_end = nullptr;
+        for (size_t i = start; i + 3 < size; ++i) {
+            if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+                head_end = data + i;
+                break;
+            }
+        }
+        if (!head_end)
+            return size - start > max_header ? 431 : 0;
+        if (size_t(head_end - data) > max_header)
+            return 431;
+
+        // Request line: <method> <target> HTTP/1.<minor>
+        const char* p        = data + start;
+        const char* line_end = static_cast<const char*>(memchr(p, '\r', head_end - p + 2));
+        const char* sp1      = static_cast<const char*>(memchr(p, ' ', line_end - p));
+        const char* sp2      = sp1 ? static_cast<const char*>(memchr(sp1 + 1, ' ', line_end - sp1 - 1)) : nullptr;
+        if (!sp1 || !sp2 || line_end - sp2 != 9 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0)
+            return 400;
+        r.method_ = string(p, sp1);
+        string target(sp1 + 1, sp2);
+        auto question = target.find('?');
+        r.path_       = target.substr(0, question);
+        r.query_      = question != string::npos ? target.substr(question + 1) : string();
+        r.keep_alive_ = sp2[8] != '0';
+
+        size_t content_length = 0;
+        for (p = line_end + 2; p < head_end; p = line_end + 2) {
+            line_end          = static_cast<const char*>(memchr(p, '\r', head_end - p + 2));
+            const char* colon = static_cast<const char*>(memchr(p, ':', line_end - p));
+            if (!colon)
+                return 400;
+            const char* value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                ++value;
+            string v(value, line_end);
+            while (!v.empty() && (v.back() == ' ' || v.back() == '\t'))
+                v.pop_back();
+
+            if (equals_nocase(p, colon - p, "content-length")) {
+                char* end;
+                auto n = strtoul(v.c_str(), &end, 10);
+                if (v.empty() || *end || n > max_body)
+                    return n > max_body ? 413 : 400;
+                content_length = n;
+            } else if (equals_nocase(p, colon - p, "transfer-encoding"))
+                return 411;
+            else if (equals_nocase(p, colon - p, "connection")) {
+                if (contains_nocase(v, "close"))
+                    r.keep_alive_ = false;
+                else if (contains_nocase(v, "keep-alive"))
+                    r.keep_alive_ = true;
+            } else if (equals_nocase(p, colon - p, "x-lease-token"))
+                r.lease_token_ = v;
+        }
+
+        const size_t head_size = size_t(head_end - data) + 4;
+        if (size - head_size < content_length)
+            return 0;
+        r.body_.assign(data + head_size, content_length);
+        used = head_size + content_length;
+        return 0;
+    }
+
+    const char* reason(int status)
+    {
+        switch (status) {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 409:
+            return "Conflict";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Payload Too Large";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Error";
+        }
+    }
+
+    string response(int status, const string& body, bool keep_alive, const char* content_type)
+    {
+        char head[256];
+        snprintf(head,
+                 sizeof head,
+                 "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+                 status,
+                 reason(status),
+                 content_type,
+                 body.size(),
+                 keep_alive ? "" : "Connection: close\r\n");
+        return head + body;
+    }
+
+    string chunked_head(int status, const char* content_type)
+    {
+        char head[256];
+        snprintf(head,
+                 sizeof head,
+                 "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nCache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n\r\n",
+                 status,
+                 reason(status),
+                 content_type);
+        return head;
+    }
+
+    string chunk(const string& data)
+    {
+        char size[16];
+        snprintf(size, sizeof size, "%zx\r\n", data.size());
+        return size + data + "\r\n";
+    }
+}
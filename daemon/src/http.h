@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace http
+{
+    struct request {
+        std::string method_;
+        std::string path_;   // Target without the query
+        std::string query_;  // After '?', empty if none
+        std::string body_;
+        std::string lease_token_;  // X-Lease-Token header
+        bool keep_alive_{};        // Persistent connection, per version and Connection header
+    };
+
+    // Incremental parser of HTTP/1.x requests on a connection, pipelined requests included.
+    // Bodies need a Content-Length, chunked request bodies aren't supported.
+    struct request_parser {
+        enum { max_header = 8192, max_body = 256 * 1024 };
+
+        // Calls on_request(request&) for each complete request. Returns the HTTP status to
+        // answer with before closing the connection if the stream is malformed, else 0.
+        template <typename OnRequest>
+        int feed(const char* data, size_t length, OnRequest&& on_request)
+        {
+            buffer_.append(data, length);
+            size_t consumed = 0;
+            for (;;) {
+                request r;
+                size_t used = 0;
+                int status  = parse(buffer_.data() + consumed, buffer_.size() - consumed, r, used);
+                if (status != 0)
+                    return status;
+                if (used == 0)
+                    break;
+                consumed += used;
+                on_request(r);
+            }
+            buffer_.erase(0, consumed);
+            return 0;
+        }
+
+    private:
+        // Parses one request from the start of `data`, sets `used` to its length or leaves it
+        // 0 if the request is incomplete.
+        int parse(const char* data, size_t size, request& r, size_t& used);
+
+        std::string buffer_;
+    };
+
+    // Reason phrase of a status code.
+    const char* reason(int status);
+
+    // A complete response with a Content-Length.
+    std::string response(int status, const std::string& body, bool keep_alive,
+                         const char* content_type = "application/json");
+
+    // Head of a response whose body follows in chunks, e.g. an event stream.
+    std::string chunked_head(int status, const char* content_type);
+    // One chunk of a chunked body.
+    std::string chunk(const std::string& data);
+}
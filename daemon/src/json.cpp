@@ -0,0 +1,263 @@
+#include "json.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    // Recursive descent over the text, nesting is limited so a hostile body can't exhaust the stack.
+    struct parser {
+        enum { max_depth = 32 };
+
+        const char* p_;
+        const char* end_;
+        int depth_{};
+
+        [[noreturn]] static void fail() { throw runtime_error("Syntax"); }
+
+        void skip_space()
+        {
+            while (p_ != end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\r' || *p_ == '\n'))
+                ++p_;
+        }
+
+        bool literal(const char* word)
+        {
+            size_t len = strlen(word);
+            if (size_t(end_ - p_) < len || memcmp(p_, word, len) != 0)
+                return false;
+            p_ += len;
+            return true;
+        }
+
+        void append_utf8(string& out, unsigned code)
+        {
+            if (code < 0x80)
+                out += char(code);
+            else if (code < 0x800) {
+                out += char(0xc0 | (code >> 6));
+                out += char(0x80 | (code & 0x3f));
+            } else {
+                out += char(0xe0 | (code >> 12));
+                out += char(0x80 | ((code >> 6) & 0x3f));
+                out += char(0x80 | (code & 0x3f));
+            }
+        }
+
+        string parse_string()
+        {
+            string out;
+            ++p_;  // Opening quote
+            for (;;) {
+                if (p_ == end_)
+                    fail();
+                char c = *p_++;
+                if (c == '"')
+                    return out;
+                if (uint8_t(c) < 0x20)
+                    fail();
+                if (c != '\\') {
+                    out += c;
+                    continue;
+                }
+                if (p_ == end_)
+                    fail();
+                switch (*p_++) {
+                case '"':
+                    out += '"';
+                    break;
+                case '\\':
+                    out += '\\';
+                    break;
+                case '/':
+                    out += '/';
+                    break;
+                case 'b':
+                    out += '\b';
+                    break;
+                case 'f':
+                    out += '\f';
+                    break;
+                case 'n':
+                    out += '\n';
+                    break;
+                case 'r':
+                    out += '\r';
+                    break;
+                case 't':
+                    out += '\t';
+                    break;
+                case 'u': {
+                    // Surrogate pairs aren't combined, paths and names are expected to be plain
+                    if (end_ - p_ < 4)
+                        fail();
+                    char hex[5] = {p_[0], p_[1], p_[2], p_[3], '\0'};
+                    char* hex_end;
+                    auto code = strtoul(hex, &hex_end, 16);
+                    if (hex_end != hex + 4)
+                        fail();
+                    append_utf8(out, unsigned(code));
+                    p_ += 4;
+                } break;
+                default:
+                    fail();
+                }
+            }
+        }
+
+        double parse_number()
+        {
+            // strtod needs a terminated string, numbers are short
+            char buf[64];
+            size_t len = 0;
+            while (p_ + len != end_ && len < sizeof buf - 1 && strchr("+-0123456789.eE", p_[len]))
+                ++len;
+            memcpy(buf, p_, len);
+            buf[len] = '\0';
+            char* number_end;
+            double d = strtod(buf, &number_end);
+            if (len == 0 || number_end != buf + len || !isfinite(d))
+                fail();
+            p_ += len;
+            return d;
+        }
+
+        json::value parse_value()
+        {
+            json::value v;
+            skip_space();
+            if (p_ == end_)
+                fail();
+            if (++depth_ > max_depth)
+                fail();
+            switch (*p_) {
+            case '{':
+                v.type_ = json::value::type::object;
+                ++p_;
+                skip_space();
+                if (p_ != end_ && *p_ == '}') {
+                    ++p_;
+                    break;
+                }
+                for (;;) {
+                    skip_space();
+                    if (p_ == end_ || *p_ != '"')
+                        fail();
+                    auto key = parse_string();
+                    skip_space();
+                    if (p_ == end_ || *p_++ != ':')
+                        fail();
+                    v.object_.emplace_back(move(key), parse_value());
+                    skip_space();
+                    if (p_ == end_)
+                        fail();
+                    if (*p_ == '}') {
+                        ++p_;
+                        break;
+                    }
+                    if (*p_++ != ',')
+                        fail();
+                }
+                break;
+            case '[':
+                v.type_ = json::value::type::array;
+                ++p_;
+                skip_space();
+                if (p_ != end_ && *p_ == ']') {
+                    ++p_;
+                    break;
+                }
+                for (;;) {
+                    v.array_.push_back(parse_value());
+                    skip_space();
+                    if (p_ == end_)
+                        fail();
+                    if (*p_ == ']') {
+                        ++p_;
+                        break;
+                    }
+                    if (*p_++ != ',')
+                        fail();
+                }
+                break;
+            case '"':
+                v.type_   = json::value::type::string;
+                v.string_ = parse_string();
+                break;
+            default:
+                if (literal("true")) {
+                    v.type_    = json::value::type::boolean;
+                    v.boolean_ = true;
+                } else if (literal("false"))
+                    v.type_ = json::value::type::boolean;
+                else if (literal("null"))
+                    v.type_ = json::value::type::null;
+                else {
+                    v.type_   = json::value::type::number;
+                    v.number_ = parse_number();
+                }
+            }
+            --depth_;
+            return v;
+        }
+    };
+}
+
+namespace json
+{
+    const value* value::find(const string& key) const
+    {
+        for (const auto& member : object_) {
+            if (member.first == key)
+                return &member.second;
+        }
+        return nullptr;
+    }
+
+    value parse(const string& text)
+    {
+        parser p{text.data(), text.data() + text.size()};
+        auto v = p.parse_value();
+        p.skip_space();
+        if (p.p_ != p.end_)
+            parser::fail();
+        return v;
+    }
+
+    string quote(const string& s)
+    {
+        string out = "\"";
+        for (char c : s) {
+            switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (uint8_t(c) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof buf, "\\u%04x", unsigned(uint8_t(c)));
+                    out += buf;
+                } else
+                    out += c;
+            }
+        }
+        return out + "\"";
+    }
+}
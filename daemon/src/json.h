@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace json
+{
+    // Just enough JSON for the HTTP endpoint: request bodies are parsed into a tree of values,
+    // replies are written as strings by the caller with quote() for text.
+    struct value {
+        enum class type { null, boolean, number, string, array, object };
+
+        type type_{type::null};
+        bool boolean_{};
+        double number_{};
+        std::string string_;
+        std::vector<value> array_;
+        std::vector<std::pair<std::string, value>> object_;  // In document order
+
+        // Member of an object, nullptr if missing or not an object.
+        const value* find(const std::string& key) const;
+        bool is_number() const { return type_ == type::number; }
+        bool is_string() const { return type_ == type::string; }
+    };
+
+    // Throws runtime_error("Syntax") if `text` isn't a single JSON value.
+    value parse(const std::string& text);
+
+    // `s` as a JSON string, with quotes.
+    std::string quote(const std::string& s);
+}
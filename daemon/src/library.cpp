@@ -0,0 +1,220 @@
+#include "library.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    struct index_header {
+        char magic_[8];
+        uint32_t version_;
+        uint32_t entry_size_;
+    };
+
+    const index_header expected_header = {{'T', 'D', 'L', 'I', 'B', 'I', 'D', 'X'}, 1, sizeof(library::store::entry)};
+
+    bool parse_hash(const string& hex, uint64_t& hash)
+    {
+        if (hex.empty() || hex.size() > 16)
+            return false;
+        char* last = nullptr;
+        hash       = strtoull(hex.c_str(), &last, 16);
+        return *last == '\0';
+    }
+}
+
+namespace library
+{
+    store::store(const string& directory) : index_path_(directory + "/index"), programs_path_(directory + "/programs")
+    {
+#ifndef _WIN32
+        mkdir(directory.c_str(), 0755);
+#endif
+        {
+            ifstream index(index_path_, ios::binary);
+            index_header h{};
+            if (!index.read(reinterpret_cast<char*>(&h), sizeof h)) {
+                if (index.gcount() != 0)
+                    throw runtime_error("'" + index_path_ + "' is not a program library index");
+                ofstream create(index_path_, ios::binary | ios::trunc);
+                if (!create.write(reinterpret_cast<const char*>(&expected_header), sizeof expected_header))
+                    throw runtime_error("Can't create program library '" + index_path_ + "'");
+            } else if (memcmp(&h, &expected_header, sizeof h) != 0)
+                throw runtime_error("'" + index_path_ + "' is not a program library index");
+        }
+        map_index();
+    }
+
+    store::~store()
+    {
+#ifndef _WIN32
+        if (mapping_)
+            munmap(mapping_, mapping_size_);
+#endif
+    }
+
+    void store::map_index()
+    {
+#ifndef _WIN32
+        if (mapping_)
+            munmap(mapping_, mapping_size_);
+        mapping_      = nullptr;
+        mapping_size_ = 0;
+
+        int fd = open(index_path_.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("Can't open program library '" + index_path_ + "'");
+        struct stat st;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) > sizeof(index_header)) {
+            void* mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED) {
+                mapping_      = mapping;
+                mapping_size_ = size_t(st.st_size);
+            }
+        }
+        close(fd);
+#else
+        ifstream file(index_path_, ios::binary);
+        index_.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+#endif
+    }
+
+    const store::entry* store::begin() const
+    {
+#ifndef _WIN32
+        const char* data = static_cast<const char*>(mapping_);
+#else
+        const char* data = index_.data();
+#endif
+        return data ? reinterpret_cast<const entry*>(data + sizeof(index_header)) : nullptr;
+    }
+
+    const store::entry* store::end() const
+    {
+#ifndef _WIN32
+        const size_t size = mapping_size_;
+#else
+        const size_t size = index_.size();
+#endif
+        // A partly written last entry is ignored
+        return size > sizeof(index_header) ? begin() + (size - sizeof(index_header)) / sizeof(entry) : begin();
+    }
+
+    const store::entry* store::find_hash(uint64_t hash) const
+    {
+        for (auto e = end(); e != begin();) {
+            if ((--e)->hash_ == hash)
+                return e;
+        }
+        return nullptr;
+    }
+
+    uint64_t store::put(const string& name, const program::compiled_program& p)
+    {
+        if (name.size() >= sizeof(entry::name_) || name.find('\0') != string::npos || name.compare(0, 1, "#") == 0)
+            throw runtime_error("Syntax");
+
+        const auto data = p.serialize();
+        const auto hash = p.hash();
+
+        entry e{};
+        e.hash_       = hash;
+        e.size_       = uint32_t(data.size());
+        e.total_time_ = p.total_time();
+        e.steps_      = p.step_count();
+        name.copy(e.name_, name.size());
+
+        auto* existing = find_hash(hash);
+        if (existing) {
+            // Nothing to do if the name already refers to this program
+            if (!name.empty()) {
+                auto* named = find_name(name);
+                if (named && named->hash_ == hash)
+                    return hash;
+            } else {
+                for (auto i = end(); i != begin();) {
+                    --i;
+                    if (i->hash_ == hash && i->name_[0] == '\0')
+                        return hash;
+                }
+            }
+            e.offset_ = existing->offset_;
+        } else {
+            ofstream programs(programs_path_, ios::binary | ios::app);
+            programs.seekp(0, ios::end);
+            e.offset_ = uint64_t(programs.tellp());
+            if (!programs.write(data.data(), streamsize(data.size())) || !programs.flush())
+                throw runtime_error("Library");
+        }
+
+        // The entry is appended after the program data, so an interrupted store never
+        // leaves an entry pointing at missing data
+        {
+            ofstream index(index_path_, ios::binary | ios::app);
+            if (!index.write(reinterpret_cast<const char*>(&e), sizeof e) || !index.flush())
+                throw runtime_error("Library");
+        }
+        map_index();
+        return hash;
+    }
+
+    const store::entry* store::find_name(const string& name) const
+    {
+        for (auto e = end(); e != begin();) {
+            if (strncmp((--e)->name_, name.c_str(), sizeof(e->name_)) == 0)
+                return e;
+        }
+        return nullptr;
+    }
+
+    bool store::get(const string& key, program::compiled_program& p) const
+    {
+        const entry* found = nullptr;
+        if (key.compare(0, 1, "#") == 0) {
+            uint64_t hash;
+            if (parse_hash(key.substr(1), hash))
+                found = find_hash(hash);
+        } else if (!key.empty())
+            found = find_name(key);
+        if (!found)
+            return false;
+
+        string data(found->size_, '\0');
+        ifstream programs(programs_path_, ios::binary);
+        if (!programs.seekg(streamoff(found->offset_)) || !programs.read(&data[0], streamsize(data.size())))
+            return false;
+        return p.deserialize(data.data(), data.size());
+    }
+
+    vector<store::entry> store::list() const
+    {
+        vector<entry> entries;
+        set<string> seen;
+        for (auto e = end(); e != begin();) {
+            --e;
+            string name(e->name_, strnlen(e->name_, sizeof(e->name_)));
+            if (seen.insert(name.empty() ? "#" + to_hex(e->hash_) : name).second)
+                entries.push_back(*e);
+        }
+        return entries;
+    }
+
+    string to_hex(uint64_t hash)
+    {
+        char buf[17];
+        snprintf(buf, sizeof buf, "%016llx", static_cast<unsigned long long>(hash));
+        return buf;
+    }
+}
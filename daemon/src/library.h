@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "program.h"
+
+namespace library
+{
+    // Compiled programs stored on disk, by name and by content hash. A directory holds two
+    // append only files: "index" with one fixed size entry per stored program, memory mapped
+    // so opening doesn't depend on the library size, and "programs" with the serialized
+    // programs. Lookups scan the mapped index from the newest entry, so the latest program
+    // stored under a name wins.
+    struct store {
+        struct entry {
+            uint64_t hash_;
+            uint64_t offset_;      // Into the programs file
+            uint32_t size_;        // Serialized size
+            uint32_t total_time_;  // In ms
+            uint32_t steps_;
+            char name_[36];  // NUL terminated, empty if only stored by hash
+        };
+        static_assert(sizeof(entry) == 64, "Index entries are 64 bytes");
+
+        explicit store(const std::string& directory);
+        ~store();
+
+        // Stores `p` under `name` (may be empty) and returns its hash. The program data is
+        // only written once, no matter under how many names it is stored.
+        uint64_t put(const std::string& name, const program::compiled_program& p);
+        // Looks up a program by name, or by hash given as "#<hex>". Returns false if unknown.
+        bool get(const std::string& key, program::compiled_program& p) const;
+        // The latest entry for each name, and for each program stored by hash only.
+        std::vector<entry> list() const;
+
+    private:
+        store(const store&) = delete;
+        store& operator=(const store&) = delete;
+
+        const entry* begin() const;
+        const entry* end() const;
+        const entry* find_hash(uint64_t hash) const;
+        const entry* find_name(const std::string& name) const;
+        void map_index();
+
+        const std::string index_path_;
+        const std::string programs_path_;
+#ifndef _WIN32
+        void* mapping_{};
+        size_t mapping_size_{};
+#else
+        std::vector<char> index_;
+#endif
+    };
+
+    // Hash as 16 hex digits.
+    std::string to_hex(uint64_t hash);
+}
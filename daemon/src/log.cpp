@@ -0,0 +1,225 @@
+#include "log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+    // Bounded multi producer queue of records (Vyukov's design), drained by one thread. Each
+    // slot's sequence tells producers and the consumer whose turn it is, so neither locks.
+    struct ring {
+        enum { capacity = 1024 };  // Power of two
+        struct slot {
+            atomic<size_t> sequence_;
+            logging::record record_;
+        };
+
+        unique_ptr<slot[]> slots_{new slot[capacity]};
+        atomic<size_t> enqueue_position_{0};
+        size_t dequeue_position_{0};
+        atomic<uint64_t> dropped_{0};
+        atomic<size_t> written_{0};  // Records handled by the consumer
+        atomic<bool> stop_{false};
+        thread thread_;
+
+        ring()
+        {
+            for (size_t i = 0; i < capacity; ++i)
+                slots_[i].sequence_.store(i, memory_order_relaxed);
+            thread_ = thread([this] { run(); });
+        }
+        ~ring()
+        {
+            stop_ = true;
+            thread_.join();
+        }
+
+        bool push(const logging::record& r)
+        {
+            auto position = enqueue_position_.load(memory_order_relaxed);
+            for (;;) {
+                auto& s   = slots_[position & (capacity - 1)];
+                auto diff = intptr_t(s.sequence_.load(memory_order_acquire)) - intptr_t(position);
+                if (diff == 0) {
+                    if (enqueue_position_.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                        s.record_ = r;
+                        s.sequence_.store(position + 1, memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    dropped_.fetch_add(1, memory_order_relaxed);
+                    return false;
+                } else
+                    position = enqueue_position_.load(memory_order_relaxed);
+            }
+        }
+
+        bool pop(logging::record& r)
+        {
+            auto& s = slots_[dequeue_position_ & (capacity - 1)];
+            if (s.sequence_.load(memory_order_acquire) != dequeue_position_ + 1)
+                return false;
+            r = s.record_;
+            s.sequence_.store(dequeue_position_ + capacity, memory_order_release);
+            ++dequeue_position_;
+            return true;
+        }
+
+        void run()
+        {
+            string out, err;
+            uint64_t reported_drops = 0;
+            logging::record r;
+            for (;;) {
+                const bool stopping = stop_;
+                size_t count        = 0;
+                while (pop(r)) {
+                    format(r, r.level_ <= logging::level::warning ? err : out);
+                    ++count;
+                }
+                auto drops = dropped_.load(memory_order_relaxed);
+                if (drops != reported_drops) {
+                    err += "Log queue full, dropped " + to_string(drops - reported_drops) + " records\n";
+                    reported_drops = drops;
+                }
+                // One write and flush per batch, never per record
+                if (!err.empty()) {
+                    fwrite(err.data(), 1, err.size(), stderr);
+                    fflush(stderr);
+                    err.clear();
+                }
+                if (!out.empty()) {
+                    fwrite(out.data(), 1, out.size(), stdout);
+                    fflush(stdout);
+                    out.clear();
+                }
+                written_.fetch_add(count, memory_order_release);
+                if (stopping && count == 0)
+                    return;
+                if (count == 0)
+                    this_thread::sleep_for(chrono::milliseconds(5));
+            }
+        }
+
+        static void format(const logging::record& r, string& line)
+        {
+            static const char* const names[] = {"error", "warning", "info", "debug"};
+            time_t seconds = time_t(r.time_ / 1000000);
+            tm t;
+#ifdef _WIN32
+            localtime_s(&t, &seconds);
+#else
+            localtime_r(&seconds, &t);
+#endif
+            char prefix[40];
+            snprintf(prefix,
+                     sizeof prefix,
+                     "%02d:%02d:%02d.%06d %s ",
+                     t.tm_hour,
+                     t.tm_min,
+                     t.tm_sec,
+                     int(r.time_ % 1000000),
+                     names[size_t(r.level_)]);
+            line += prefix;
+
+            size_t argument = 0;
+            for (const char* f = r.format_; *f; ++f) {
+                if (f[0] != '{' || f[1] != '}' || argument == r.count_) {
+                    line += *f;
+                    continue;
+                }
+                ++f;
+                char buf[32];
+                const auto& v = r.values_[argument];
+                switch (r.types_[argument++]) {
+                case logging::record::type::integer:
+                    snprintf(buf, sizeof buf, "%lld", static_cast<long long>(v.integer_));
+                    line += buf;
+                    break;
+                case logging::record::type::unsigned_integer:
+                    snprintf(buf, sizeof buf, "%llu", static_cast<unsigned long long>(v.unsigned_));
+                    line += buf;
+                    break;
+                case logging::record::type::real:
+                    snprintf(buf, sizeof buf, "%g", v.real_);
+                    line += buf;
+                    break;
+                case logging::record::type::text:
+                    line += r.text_ + v.text_offset_;
+                    break;
+                }
+            }
+            line += '\n';
+        }
+    };
+
+    ring& queue()
+    {
+        static ring r;
+        return r;
+    }
+}
+
+namespace logging
+{
+    atomic<level> threshold_{level::info};
+
+    void set_level(level l) { threshold_ = l; }
+
+    bool parse_level(const string& name, level& l)
+    {
+        static const char* const names[] = {"error", "warning", "info", "debug"};
+        for (size_t i = 0; i < 4; ++i) {
+            if (name == names[i]) {
+                l = level(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void record::add(const char* s)
+    {
+        if (count_ == max_arguments || text_used_ >= text_size)
+            return;
+        // Truncated to what is left of the text area, always terminated
+        size_t room = text_size - text_used_;
+        size_t len  = strnlen(s, room - 1);
+        memcpy(text_ + text_used_, s, len);
+        text_[text_used_ + len]        = '\0';
+        types_[count_]                 = type::text;
+        values_[count_++].text_offset_ = text_used_;
+        text_used_                     = uint8_t(text_used_ + len + 1);
+    }
+
+    void record::add(double d)
+    {
+        if (count_ == max_arguments)
+            return;
+        types_[count_]          = type::real;
+        values_[count_++].real_ = d;
+    }
+
+    void submit(record& r)
+    {
+        r.time_ = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        queue().push(r);
+    }
+
+    uint64_t dropped() { return queue().dropped_.load(memory_order_relaxed); }
+
+    void flush()
+    {
+        auto& q = queue();
+        // Everything claimed so far, less what was dropped, has to be written
+        const auto target = q.enqueue_position_.load(memory_order_acquire);
+        while (q.written_.load(memory_order_acquire) < target)
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
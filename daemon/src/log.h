@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+namespace logging
+{
+    enum class level : uint8_t { error, warning, info, debug };
+
+    // Records above this level are discarded where they are made, default is info.
+    void set_level(level l);
+    // Parses "error", "warning", "info" or "debug".
+    bool parse_level(const std::string& name, level& l);
+
+    // A log line in binary form: the arguments are stored as is and only formatted into the
+    // format string by the logger thread. Text arguments are copied, truncated if long.
+    struct record {
+        enum { max_arguments = 6, text_size = 120 };
+        enum class type : uint8_t { integer, unsigned_integer, real, text };
+
+        int64_t time_;        // System clock in us
+        const char* format_;  // "{}" is replaced by the next argument, must be a string literal
+        level level_;
+        uint8_t count_;
+        uint8_t text_used_;
+        type types_[max_arguments];
+        union {
+            int64_t integer_;
+            uint64_t unsigned_;
+            double real_;
+            uint8_t text_offset_;
+        } values_[max_arguments];
+        char text_[text_size];
+
+        void add(const char* s);
+        void add(const std::string& s) { add(s.c_str()); }
+        void add(double d);
+        template <typename T>
+        typename std::enable_if<std::is_integral<T>::value>::type add(T v)
+        {
+            if (count_ == max_arguments)
+                return;
+            if (std::is_signed<T>::value) {
+                types_[count_]             = type::integer;
+                values_[count_++].integer_ = int64_t(v);
+            } else {
+                types_[count_]              = type::unsigned_integer;
+                values_[count_++].unsigned_ = uint64_t(v);
+            }
+        }
+        template <typename T>
+        typename std::enable_if<std::is_enum<T>::value>::type add(T v)
+        {
+            add(typename std::underlying_type<T>::type(v));
+        }
+    };
+
+    extern std::atomic<level> threshold_;
+
+    inline bool enabled(level l) { return l <= threshold_.load(std::memory_order_relaxed); }
+
+    // Queues the record for the logger thread without blocking. If the queue is full the
+    // record is dropped and counted, the count is logged once there is room again.
+    void submit(record& r);
+    // Records dropped so far.
+    uint64_t dropped();
+    // Blocks until everything queued so far is written.
+    void flush();
+
+    inline void add_arguments(record&) {}
+    template <typename First, typename... Rest>
+    void add_arguments(record& r, const First& first, const Rest&... rest)
+    {
+        r.add(first);
+        add_arguments(r, rest...);
+    }
+
+    template <typename... Args>
+    void write(level l, const char* format, const Args&... args)
+    {
+        if (!enabled(l))
+            return;
+        record r;
+        r.format_    = format;
+        r.level_     = l;
+        r.count_     = 0;
+        r.text_used_ = 0;
+        add_arguments(r, args...);
+        submit(r);
+    }
+
+    template <typename... Args>
+    void error(const char* format, const Args&... args)
+    {
+        write(level::error, format, args...);
+    }
+    template <typename... Args>
+    void warning(const char* format, const Args&... args)
+    {
+        write(level::warning, format, args...);
+    }
+    template <typename... Args>
+    void info(const char* format, const Args&... args)
+    {
+        write(level::info, format, args...);
+    }
+    template <typename... Args>
+    void debug(const char* format, const Args&... args)
+    {
+        write(level::debug, format, args...);
+    }
+}
@@ -7,15 +7,40 @@
 //
 //
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <random>
+#include <set>
+#include <thread>
 #include <utility>
 
 #include <asio.hpp>
 #include <asio/deadline_timer.hpp>
 
+#include "audio.h"
+#include "gpio.h"
+#include "http.h"
+#include "json.h"
+#include "library.h"
+#include "log.h"
+#include "metrics.h"
+#include "netmon.h"
+#include "program.h"
+#include "protocol.h"
+#include "realtime.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "timesync.h"
+#include "timing.h"
 #include "utility.h"
 
 #include <CLI/CLI.hpp>
@@ -26,94 +51,225 @@ using namespace std;
 
 #if RASPBERRY_PI
 #include <pigpio.h>
-
-enum GPIO {              // GPIO pin
-    ENABLE         = 0,  // 11
-    TURN_FRONT     = 2,  // 13
-    TURN_AWAY      = 3,  // 15
-    SERVER_READY   = 1,  // 12
-    SESSION_ACTIVE = 4,  // 16
-    PROGRAM_ACTIVE = 5,  // 18
-    BUTTON         = 6,  // 22 (input active low)
-};
-
-struct gpio_init_handler {
-    gpio_init_handler()
-    {
-        if (++instances_ == 1) {
-            if (gpioInitialise() < 0)
-                throw runtime_error("GPIO not available!!");
-            gpioSetMode(GPIO::TURN_FRONT, PI_OUTPUT);
-            gpioSetMode(GPIO::TURN_AWAY, PI_OUTPUT);
-            gpioSetMode(GPIO::ENABLE, PI_OUTPUT);
-            gpioSetMode(GPIO::SERVER_READY, PI_OUTPUT);
-            gpioSetMode(GPIO::SESSION_ACTIVE, PI_OUTPUT);
-            gpioSetMode(GPIO::PROGRAM_ACTIVE, PI_OUTPUT);
-            gpioSetMode(GPIO::BUTTON, PI_INPUT);
-            // 20 ms glitch filter on button
-            gpioGlitchFilter(GPIO::BUTTON, 20000);
-        }
-    }
-    ~gpio_init_handler()
-    {
-        if (--instances_ == 0) {
-            gpioTerminate();
-        }
-    }
-
-private:
-    static atomic<int> instances_;
-};
-
-atomic<int> gpio_init_handler::instances_{0};
-#else
-struct gpio_init_handler {
-};
 #endif
 
 namespace
 {
     string audioPlayCmdLinePrefix_{};
+    unique_ptr<audio::engine> audioEngine_{};  // In-process playback, if enabled
+    metrics::histogram audioLatency_;          // Time from audio trigger until played
     int sessionTimeout_ = 20;  // Inactivity timeout before session terminates.
+    unique_ptr<library::store> library_{};  // Stored programs, if enabled
 
-    // trim from start
-    static string ltrim(string&& s)
-    {
-        s.erase(s.begin(), find_if(s.begin(), s.end(), not1(ptr_fun<int, int>(isspace))));
-        return move(s);
-    }
-
-    // trim from end
-    static string rtrim(string&& s)
-    {
-        s.erase(find_if(s.rbegin(), s.rend(), not1(ptr_fun<int, int>(isspace))).base(), s.end());
-        return move(s);
-    }
+    // What happens to a running program when the controlling session is lost
+    enum class disconnect_policy {
+        stop,          // Stop the program and release the lease
+        keep_running,  // Keep running, the lease is kept for the resume token for resumeGrace_ seconds
+    };
+    disconnect_policy disconnectPolicy_ = disconnect_policy::stop;
+    int resumeGrace_                    = 30;
+    timesync::clock_sync* clockSync_{};  // Offset to the reference daemon, if not the reference
+
+    // Time of the timebase shared by all daemons, the reference daemon's system clock.
+    int64_t shared_time_us() { return timesync::now_us() + (clockSync_ ? clockSync_->offset().count() : 0); }
+    vector<gpio::lane_pins> lanes_{{GPIO::TURN_FRONT, GPIO::TURN_AWAY}};
+    chrono::microseconds stepSpin_{0};  // Busy waited before each step, in real-time mode
+    // How much earlier than its program time each kind of step is fired, so that the sound is
+    // heard and the target faces the shooter on time
+    chrono::microseconds audioLead_{0};
+    chrono::microseconds moveLead_{0};
 
-    // trim from both ends
-    static string trim(string&& s) { return ltrim(rtrim(move(s))); }
+    struct client_exit {
+    };
 
-    static vector<string> split_commands(string s, string delimiters = ";\n")
-    {
-        vector<string> retval;
-        auto append = [&](string s) {
-            auto entry = trim(move(s));
-            if (!entry.empty())
-                retval.emplace_back(move(entry));
+    // Turns the targets of all lanes by pulsing their front or away pin. Runs as a state
+    // machine per lane on the io_context, driven by one timer: a pulse is followed by a settle
+    // time, and a move requested meanwhile waits for it. A reversal during a pulse drops the
+    // active pin at once and then starts the opposite pulse after the settle time, so both
+    // pins of a lane are never driven together. All lanes changing at the same time are
+    // written in one register write.
+    struct target_control {
+        using clock_type = timing::clock;
+        enum class state { idle, pulsing, settling };
+
+        static constexpr chrono::microseconds pulse_width{500000};
+        static constexpr chrono::microseconds settle_time{50000};
+
+        struct lane {
+            gpio::lane_pins pins_;
+            state state_{state::idle};
+            clock_type::time_point deadline_{};
+            int pending_{-1};  // Position to move to when settled, or -1
+            bool active_front_{};
         };
-        size_t last = 0;
-        size_t next = 0;
-        while ((next = s.find_first_of(delimiters, last)) != string::npos) {
-            append(s.substr(last, next - last));
-            last = next + 1;
-        }
-        append(s.substr(last));
-        return move(retval);
-    }
 
-    struct client_exit {
+        atomic<uint32_t> positions_{0};  // Bit per lane, set if facing front
+        asio::io_context& io_context_;
+        gpio::backend& gpio_;
+        timing::timer timer_;
+        vector<lane> lanes_;
+
+        typedef function<void(bool position, uint32_t lanes)> on_moved_type;
+        on_moved_type on_moved_;  // Called on the io_context when a move starts
+
+        metrics::histogram move_latency_;  // Time from move_target() to the GPIO write
+
+        target_control(asio::io_context& io_context, gpio::backend& backend, const vector<gpio::lane_pins>& pins)
+            : io_context_(io_context), gpio_(backend), timer_(io_context)
+        {
+            for (const auto& p : pins) {
+                lanes_.push_back(lane{p});
+                gpio_.configure_output(p.front_);
+                gpio_.configure_output(p.away_);
+            }
+            gpio_.write_masks(0, pin_mask(all_lanes(), true) | pin_mask(all_lanes(), false));
+            gpio_.write(GPIO::ENABLE, true);
+        }
+        ~target_control()
+        {
+            gpio_.stop_pulse();
+            gpio_.write_masks(0, pin_mask(all_lanes(), true) | pin_mask(all_lanes(), false));
+            gpio_.write(GPIO::ENABLE, false);
+        }
+
+        size_t lane_count() const { return lanes_.size(); }
+        uint32_t all_lanes() const { return (1u << lanes_.size()) - 1; }
+
+        // Thread safe, never blocks. `lanes` is a bit mask, bit 0 is the first lane.
+        void move_target(bool toFront, uint32_t lanes)
+        {
+            const auto requested = clock_type::now();
+            asio::post(io_context_, [this, toFront, lanes, requested] { on_move(toFront, lanes, requested); });
+        }
+        void move_target(bool toFront) { move_target(toFront, all_lanes()); }
+
+        // Position of the first lane.
+        bool position() const { return positions_ & 1; }
+        uint32_t positions() const { return positions_; }
+
+    private:
+        // Mask of the front (or away) pins of `lanes`.
+        uint32_t pin_mask(uint32_t lanes, bool front) const
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < lanes_.size(); ++i) {
+                if ((lanes >> i) & 1)
+                    mask |= 1u << (front ? lanes_[i].pins_.front_ : lanes_[i].pins_.away_);
+            }
+            return mask;
+        }
+
+        void on_move(bool toFront, uint32_t lanes, clock_type::time_point requested)
+        {
+            const auto now   = clock_type::now();
+            uint32_t start   = 0;
+            uint32_t reverse = 0;
+            for (size_t i = 0; i < lanes_.size(); ++i) {
+                if (!((lanes >> i) & 1))
+                    continue;
+                auto& l = lanes_[i];
+                switch (l.state_) {
+                case state::idle:
+                    start |= 1u << i;
+                    break;
+
+                case state::pulsing:
+                    if (l.active_front_ == toFront)
+                        break;  // Already moving there
+                    reverse |= 1u << i;
+                    l.state_    = state::settling;
+                    l.deadline_ = now + settle_time;
+                    l.pending_  = toFront;
+                    break;
+
+                case state::settling:
+                    l.pending_ = toFront;  // Latest request wins
+                    break;
+                }
+            }
+            if (reverse) {
+                gpio_.stop_pulse();
+                gpio_.write_masks(0, pin_mask(reverse, !toFront));
+            }
+            if (start) {
+                start_pulses(toFront ? start : 0, toFront ? 0 : start, now);
+                move_latency_.record(clock_type::now() - requested);
+            }
+            arm();
+        }
+
+        // Starts pulses on the lanes in `front` and `away` together.
+        void start_pulses(uint32_t front, uint32_t away, clock_type::time_point now)
+        {
+            const uint32_t set = pin_mask(front, true) | pin_mask(away, false);
+            // Prefer a pulse timed by the backend, the timer then only tracks the state
+            if (!gpio_.start_pulse(set, pulse_width))
+                gpio_.write_masks(set, 0);
+
+            for (size_t i = 0; i < lanes_.size(); ++i) {
+                if (!(((front | away) >> i) & 1))
+                    continue;
+                auto& l         = lanes_[i];
+                l.state_        = state::pulsing;
+                l.deadline_     = now + pulse_width;
+                l.active_front_ = (front >> i) & 1;
+            }
+            positions_ = (positions_ | front) & ~away;
+            if (on_moved_) {
+                if (front)
+                    on_moved_(true, front);
+                if (away)
+                    on_moved_(false, away);
+            }
+        }
+
+        void arm()
+        {
+            auto next = clock_type::time_point::max();
+            for (const auto& l : lanes_) {
+                if (l.state_ != state::idle && l.deadline_ < next)
+                    next = l.deadline_;
+            }
+            if (next == clock_type::time_point::max())
+                return;
+            timer_.expires_at(next);
+            timer_.async_wait([this](const asio::error_code& ec) {
+                if (!ec)
+                    on_timer();
+            });
+        }
+
+        void on_timer()
+        {
+            const auto now = clock_type::now();
+            uint32_t clear = 0, front = 0, away = 0;
+            for (size_t i = 0; i < lanes_.size(); ++i) {
+                auto& l = lanes_[i];
+                if (l.state_ == state::idle || l.deadline_ > now)
+                    continue;
+                if (l.state_ == state::pulsing) {
+                    clear |= 1u << (l.active_front_ ? l.pins_.front_ : l.pins_.away_);
+                    l.state_ = state::settling;
+                    l.deadline_ += settle_time;
+                } else {
+                    l.state_ = state::idle;
+                    if (l.pending_ >= 0)
+                        (l.pending_ ? front : away) |= 1u << i;
+                    l.pending_ = -1;
+                }
+            }
+            // Clearing also ends pulses a hardware waveform was preempted from
+            if (clear)
+                gpio_.write_masks(0, clear);
+            if (front | away)
+                start_pulses(front, away, now);
+            arm();
+        }
     };
 
+    constexpr chrono::microseconds target_control::pulse_width;
+    constexpr chrono::microseconds target_control::settle_time;
+
 #if RASPBERRY_PI
     struct server_ready_marker : gpio_init_handler {
         server_ready_marker() { gpioWrite(GPIO::SERVER_READY, 1); }
@@ -121,8 +277,8 @@ namespace
     };
 
     struct session_active_marker : gpio_init_handler {
-        server_ready_marker() { gpioWrite(GPIO::SESSION_ACTIVE, 1); }
-        ~server_ready_marker() { gpioWrite(GPIO::SESSION_ACTIVE, 0); }
+        session_active_marker() { gpioWrite(GPIO::SESSION_ACTIVE, 1); }
+        ~session_active_marker() { gpioWrite(GPIO::SESSION_ACTIVE, 0); }
     };
 
     struct running_program_marker : gpio_init_handler {
@@ -130,417 +286,2317 @@ namespace
         ~running_program_marker() { gpioWrite(GPIO::PROGRAM_ACTIVE, 0); }
     };
 
-    struct target_control : gpio_init_handler {
-        atomic<bool> position_{false};
+    // Used to manually turn targets back&forth
+    struct button_handler : gpio_init_handler {
+        target_control& target_control_;
+        asio::io_context& io_context_;
+        function<void()> on_pressed_;  // Called on io_context_
 
-        target_control()
+        static void eventFuncEx(int event, int level, uint32_t tick, void* userdata)
         {
-            gpioWrite(GPIO::TURN_FRONT, 0);
-            gpioWrite(GPIO::TURN_AWAY, 0);
-            gpioWrite(GPIO::ENABLE, 1);
+            if (event != GPIO::BUTTON)
+                return;
+
+            if (level != 0)  // If not change to low
+                return;
+
+            ((button_handler*)userdata)->on_button();
         }
-        ~target_control()
+
+        button_handler(target_control& control, asio::io_context& io_context, function<void()> on_pressed)
+            : target_control_(control), io_context_(io_context), on_pressed_(on_pressed)
         {
-            gpioWrite(GPIO::TURN_FRONT, 0);
-            gpioWrite(GPIO::TURN_AWAY, 0);
-            gpioWrite(GPIO::ENABLE, 0);
+            gpioSetAlertFuncEx(GPIO::BUTTON, eventFuncEx, this);
         }
+        ~button_handler() { gpioSetAlertFuncEx(GPIO::BUTTON, NULL, NULL); }
 
-        future<void> move_target(bool toFront)
+        void on_button()
         {
-            return async(launch::async, [this, toFront]() mutable {
-                position_         = toFront ? 1 : 0;
-                const int gpioBit = toFront ? GPIO::TURN_FRONT : GPIO::TURN_AWAY;
-                gpioWrite(gpioBit, 1);
-                this_thread::sleep_for(chrono::milliseconds(500));
-                gpioWrite(gpioBit, 0);
-                this_thread::sleep_for(chrono::milliseconds(50));
-            });
+            if (on_pressed_)
+                asio::post(io_context_, on_pressed_);
+            target_control_.move_target(!target_control_.position());
         }
+    };
 
-        bool position() const { return position_; }
+#else
+    // Dummy implementations
+    struct server_ready_marker {
     };
+    struct session_active_marker {
+    };
+    struct running_program_marker {
+    };
+    struct button_handler {
+        button_handler(target_control&, asio::io_context&, function<void()>) {}
+    };
+#endif
 
-    // Used to manually turn targets back&forth
-    struct button_handler : gpio_init_handler {
+    // Runs `count` steps 1 ms apart through a step scheduler, as a program would, and returns
+    // their lateness. Tells whether the kernel and configuration deliver in real-time mode.
+    metrics::histogram::summary jitter_test(size_t count)
+    {
+        asio::io_context io_context;
+        metrics::histogram lateness;
+        auto s = scheduler::step_scheduler::create(io_context);
+        s->set_spin(stepSpin_);
+        s->start(count,
+                 [](size_t index) { return chrono::milliseconds(10 + index); },
+                 [&](size_t, scheduler::step_scheduler::clock_type::duration late) { lateness.record(late); },
+                 [] {});
+        io_context.run();
+        return lateness.take();
+    }
+
+    struct session;
+
+    // One event in the format of each front end, each built when first needed.
+    struct event_message {
+        const string& what_;
+        string line_, frame_, stream_;
+
+        explicit event_message(const string& what) : what_(what) {}
+
+        // "EVENT=<what>\r\n"
+        const string& line()
+        {
+            if (line_.empty())
+                line_ = "EVENT=" + what_ + "\r\n";
+            return line_;
+        }
+        const string& frame()
+        {
+            if (frame_.empty())
+                protocol::binary::encode(
+                    frame_, protocol::binary::opcode::event, protocol::status::ok, 0, what_.data(), what_.size());
+            return frame_;
+        }
+        // Server-sent event in an HTTP chunk: data: {"event":"<name>","args":[...]}
+        const string& stream()
+        {
+            if (stream_.empty()) {
+                auto comma  = what_.find(',');
+                string data = "data: {\"event\":" + json::quote(what_.substr(0, comma)) + ",\"args\":[";
+                while (comma != string::npos) {
+                    auto next = what_.find(',', comma + 1);
+                    auto arg  = what_.substr(comma + 1, next - comma - 1);
+                    char* end;
+                    strtod(arg.c_str(), &end);
+                    data += (data.back() == '[' ? "" : ",") + (!arg.empty() && !*end ? arg : json::quote(arg));
+                    comma = next;
+                }
+                stream_ = http::chunk(data + "]}\n\n");
+            }
+            return stream_;
+        }
+    };
+
+    struct event_subscriber {
+        virtual ~event_subscriber() = default;
+        virtual void send_event(event_message& e) = 0;
+    };
+
+    // Fans out asynchronous events to the sessions that subscribed with 'E' and to HTTP event
+    // streams.
+    struct event_publisher {
+        set<event_subscriber*> subscribers_;
+
+        bool active() const { return !subscribers_.empty(); }
+        void subscribe(event_subscriber* s) { subscribers_.insert(s); }
+        void unsubscribe(event_subscriber* s) { subscribers_.erase(s); }
+
+        void publish(const string& what)
+        {
+            event_message e(what);
+            for (auto s : subscribers_)
+                s->send_event(e);
+        }
+    };
+
+    // What queries see of the executor. Published by the executor on every change, so it can
+    // be read from any thread without touching the executor itself.
+    struct executor_state {
+        bool running_;
+        bool has_program_;
+        uint8_t lane_count_;   // 0 if there is no target
+        uint32_t step_;        // Index of the next step
+        uint32_t total_time_;  // In ms
+        uint32_t positions_;   // Bit per lane, set if facing front
+        int64_t start_time_;   // Steady clock time of program start, in ns
+    };
+
+    // Finding of arming a program.
+    struct arm_warning {
+        enum class kind { spacing, audio };
+        kind kind_;
+        size_t step_;
+        uint32_t lanes_;   // Spacing: lanes moved too soon
+        uint32_t gap_ms_;  // Spacing: shortest time since their previous move
+        string path_;      // Audio: file that can't be played
+    };
+
+    // Steps of a program in the order they're fired, each ahead of its time by the lead of its
+    // action but not before the start. The expanded program is walked once for audio and once
+    // for move steps, each in time order, and the two are merged on their fire time.
+    struct fire_order {
+        struct stream {
+            program::cursor cursor_;
+            program::opcode op_;
+            chrono::microseconds lead_;
+            program::step step_{};
+            chrono::microseconds offset_{};  // From the program start
+            bool valid_{};
+
+            void next()
+            {
+                while ((valid_ = cursor_.next(step_)) && step_.op_ != op_) {
+                }
+                if (valid_)
+                    offset_ = max(chrono::microseconds(chrono::milliseconds(step_.time_)) - lead_,
+                                  chrono::microseconds::zero());
+            }
+        };
+
+        explicit fire_order(const program::compiled_program& p)
+            : streams_{{program::cursor(p), program::opcode::play_audio, audioLead_},
+                       {program::cursor(p), program::opcode::move_target, moveLead_}}
+        {
+            streams_[0].next();
+            streams_[1].next();
+            pick();
+        }
+
+        // The k:th step to fire, k never decreases between calls. Must not be past the last.
+        const stream& at(size_t k)
+        {
+            for (; position_ < k; ++position_) {
+                streams_[current_].next();
+                pick();
+            }
+            return streams_[current_];
+        }
+
+    private:
+        // Earliest of the two, in program order if fired at the same time
+        void pick()
+        {
+            const auto& a = streams_[0];
+            const auto& b = streams_[1];
+            current_ = !a.valid_ || (b.valid_ && (b.offset_ < a.offset_ ||
+                                                  (b.offset_ == a.offset_ && b.step_.index_ < a.step_.index_)));
+        }
+
+        stream streams_[2];
+        size_t position_{};
+        size_t current_{};
+    };
+
+    // Runs `f` on the thread running `io_context` and waits for it to return.
+    template <typename F>
+    void run_on(asio::io_context& io_context, F&& f)
+    {
+        promise<void> done;
+        asio::post(io_context, [&] {
+            f();
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+
+    // The thread steps are dispatched on in real-time mode, with its own io_context. Only it
+    // runs SCHED_FIFO and pinned, so that sessions, HTTP, netlink and library writes stay on
+    // the main thread at normal priority, neither delaying a step nor running at its priority.
+    struct dispatch_thread {
+        asio::io_context io_context_;
+        thread thread_;
+
+        ~dispatch_thread()
+        {
+            if (!thread_.joinable())
+                return;
+            io_context_.stop();
+            thread_.join();
+        }
+
+        // Threads started before (logger, audio mixer, GPIO) keep the normal policy. Throws if
+        // real-time mode is refused, the thread then runs at normal priority until destroyed.
+        void start(const realtime::settings& s)
+        {
+            promise<void> entered;
+            auto result = entered.get_future();
+            thread_     = thread([this, s, &entered] {
+                auto work = asio::make_work_guard(io_context_);
+                try {
+                    realtime::enter(s);
+                    entered.set_value();
+                } catch (...) {
+                    entered.set_exception(current_exception());
+                }
+                io_context_.run();
+            });
+            result.get();
+        }
+    };
+
+    // Program and target state of the daemon, shared by all sessions. Only the session
+    // holding the controller lease may change it. Steps are dispatched and targets driven on
+    // the dispatch io_context, which is the main one unless in real-time mode; state and
+    // events are published on the main one only.
+    struct program_executor {
+        using clock_type = scheduler::step_scheduler::clock_type;
+
+        asio::io_context& io_context_;
+        asio::io_context& dispatch_;
+        program::compiled_program program_;
+        unique_ptr<program::compiled_program> dispatched_;  // Copy of program_ the scheduler runs
+        shared_ptr<scheduler::step_scheduler> scheduler_;
+        unique_ptr<running_program_marker> running_program_marker_;
+        unique_ptr<gpio::backend> gpio_;
         unique_ptr<target_control> target_control_{};
-        future<void> button_job_;
+        event_publisher events_;
+        metrics::histogram step_lateness_;  // Actual minus scheduled step time
+        metrics::histogram start_latency_;  // Start command to first step, less the step's offset
+        snapshot::seqlock<executor_state> state_;
+        unique_ptr<fire_order> fire_;
+        function<void(const string&)> on_audio_;  // Plays audio instead of the engine or player, if set
+        chrono::microseconds first_offset_{};  // Of the first step fired
+        timing::timer calibration_timer_;
+        clock_type::time_point calibration_deadline_{};
+        bool armed_{};
+        bool executing_{};      // Until the end or stop is published
+        unsigned run_{};        // Bumped by each prepare and stop, reports of earlier runs are dropped
+        bool measure_start_{};  // Started at once, not at a later time
+        clock_type::time_point start_received_{};
+
+        // Targets are driven through `backend` if given, else through the platform's GPIO.
+        explicit program_executor(asio::io_context& io_context, unique_ptr<gpio::backend> backend = nullptr)
+            : program_executor(io_context, io_context, move(backend))
+        {
+        }
+        program_executor(asio::io_context& io_context,
+                         asio::io_context& dispatch,
+                         unique_ptr<gpio::backend> backend = nullptr)
+            : io_context_(io_context)
+            , dispatch_(dispatch)
+            , scheduler_(scheduler::step_scheduler::create(dispatch))
+            , calibration_timer_(io_context)
+        {
+            scheduler_->set_spin(stepSpin_);
+            try {
+                gpio_ = backend ? move(backend) : gpio::make_backend();
+                target_control_.reset(new target_control(dispatch, *gpio_, lanes_));
+                target_control_->on_moved_ = [this](bool position, uint32_t lanes) {
+                    report([this, position, lanes] {
+                        publish_state();
+                        if (events_.active())
+                            events_.publish(string("POS,") + (position ? "1," : "0,") + to_string(lanes));
+                    });
+                };
+            } catch (exception& e) {
+                logging::error("Exception: {}", e.what());
+            }
+            publish_state();
+        }
+        ~program_executor()
+        {
+            stop_program();
+            on_dispatch([this] { target_control_ = nullptr; });
+        }
 
-        static void eventFuncEx(int event, int level, uint32_t tick, void* userdata)
+        bool is_executing() const { return executing_; }
+
+        // Runs `f` on the dispatch thread and waits for it, as the scheduler is only used there.
+        template <typename F>
+        void on_dispatch(F&& f)
         {
-            if (event != GPIO::BUTTON)
+            if (&dispatch_ == &io_context_)
+                return f();
+            run_on(dispatch_, forward<F>(f));
+        }
+
+        // Runs `f` on the main thread, queued if called on the dispatch thread, which never waits.
+        template <typename F>
+        void report(F&& f)
+        {
+            if (&dispatch_ == &io_context_)
+                return f();
+            asio::post(io_context_, forward<F>(f));
+        }
+
+        // Stops the scheduler, steps of the current run that are still to be reported are dropped.
+        void stop_dispatch()
+        {
+            ++run_;
+            on_dispatch([this] { scheduler_->stop(); });
+        }
+
+        void stop_program()
+        {
+            disarm();
+            if (is_executing()) {
+                stop_dispatch();
+                executing_              = false;
+                running_program_marker_ = nullptr;
+                publish_state();
+                logging::info("Program stopped!");
+                if (events_.active())
+                    events_.publish("STOPPED");
+            }
+        }
+
+        void clear_program()
+        {
+            stop_program();
+            program_.clear();
+            publish_state();
+        }
+
+        // Program edits go through the executor, so the published total time follows them.
+        void advance(uint32_t ms)
+        {
+            disarm();
+            program_.advance(ms);
+            publish_state();
+        }
+        void add_audio(const string& path)
+        {
+            disarm();
+            program_.add_audio(path);
+            publish_state();
+        }
+        void add_move(bool position, uint16_t lanes)
+        {
+            disarm();
+            program_.add_move(position, lanes);
+            publish_state();
+        }
+        void advance(const string& parameter)
+        {
+            disarm();
+            program_.advance(parameter);
+            publish_state();
+        }
+        void begin_repeat(uint32_t count)
+        {
+            disarm();
+            program_.begin_repeat(count);
+        }
+        void end_repeat()
+        {
+            disarm();
+            program_.end_repeat();
+        }
+        void set_parameter(const string& name, uint32_t ms)
+        {
+            disarm();
+            program_.set_parameter(name, ms);
+            publish_state();
+        }
+        void insert(size_t index, const program::instruction& instr)
+        {
+            disarm();
+            program_.insert(index, instr);
+            publish_state();
+        }
+        void replace(size_t index, const program::instruction& instr)
+        {
+            disarm();
+            program_.replace(index, instr);
+            publish_state();
+        }
+        void erase(size_t index)
+        {
+            disarm();
+            program_.erase(index);
+            publish_state();
+        }
+        void shift(size_t index, int64_t ms)
+        {
+            disarm();
+            program_.shift(index, ms);
+            publish_state();
+        }
+
+        void load_program(program::compiled_program&& p)
+        {
+            stop_program();
+            program_ = move(p);
+            publish_state();
+            if (audioEngine_) {
+                for (const auto& path : program_.strings())
+                    audioEngine_->preload(path);
+            }
+        }
+
+        void play_audio(const string& path)
+        {
+            if (on_audio_)
+                return on_audio_(path);
+            if (audioEngine_ && audioEngine_->play(path))
+                return;
+            // Fall back to the external player, e.g. for files the engine can't decode
+            if (audioPlayCmdLinePrefix_.empty())
+                return;
+            const auto requested = clock_type::now();
+            string cmdline       = audioPlayCmdLinePrefix_;
+            size_t index         = cmdline.find("{f}");
+            if (index != string::npos)
+                cmdline.replace(index, 3, path);
+            utility::spawn_detached(cmdline);
+            // Only the spawn is measured, the player's own startup is unknown
+            audioLatency_.record(clock_type::now() - requested);
+        }
+
+        // Plays `path` through the audio engine and makes the time until it's heard the audio
+        // lead. The result is reported by a CALIBRATED event, without a time if the clip stayed
+        // silent or no result came within 5 s. False if the clip can't be loaded.
+        bool calibrate_audio(const string& path)
+        {
+            if (!audioEngine_->measure(path))
+                return false;
+            calibration_deadline_ = clock_type::now() + chrono::seconds(5);
+            poll_calibration();
+            return true;
+        }
+
+        void poll_calibration()
+        {
+            // Calibration is rare, polling the engine keeps the mixer thread free of callbacks
+            calibration_timer_.expires_after(chrono::milliseconds(20));
+            calibration_timer_.async_wait([this](const asio::error_code& ec) {
+                if (ec)
+                    return;
+                auto measured = audioEngine_->measurement();
+                if (measured.count() == 0 && clock_type::now() < calibration_deadline_)
+                    return poll_calibration();
+                stringstream msg;
+                msg << fixed << setprecision(6) << "CALIBRATED,";
+                if (measured.count() > 0) {
+                    audioLead_ = measured;
+                    msg << measured.count() / 1e6;
+                    logging::info("Audio lead calibrated to {} us", measured.count());
+                } else
+                    logging::error("Audio calibration failed, lead kept at {} us", audioLead_.count());
+                if (events_.active())
+                    events_.publish(msg.str());
+            });
+        }
+
+        // Validates the program, loads everything it needs and prepares the scheduler, so that
+        // starting it only records the start time. Spacing warnings are moves of a lane closer
+        // to its previous move than a pulse and its settle time, which would cut the previous
+        // pulse short. Audio warnings are files that can't be played, reported for their first
+        // step. A repeated block repeats its warnings, so they're limited to max_warnings.
+        vector<arm_warning> arm_program()
+        {
+            const size_t max_warnings = 100;
+            vector<arm_warning> warnings;
+            const auto min_gap = uint32_t((target_control::pulse_width + target_control::settle_time).count() / 1000);
+            vector<int64_t> last_move(lanes_.size(), -int64_t(min_gap));
+            vector<bool> checked(program_.strings().size());
+            program::cursor steps(program_);
+            program::step instr;
+            while (steps.next(instr) && warnings.size() < max_warnings) {
+                const size_t i = instr.index_;
+                if (instr.op_ == program::opcode::move_target) {
+                    uint32_t close = 0, gap = min_gap;
+                    for (size_t lane = 0; lane < lanes_.size(); ++lane) {
+                        if (!((instr.operand_ >> lane) & 1))
+                            continue;
+                        if (instr.time_ - last_move[lane] < min_gap) {
+                            close |= 1u << lane;
+                            gap = min(gap, uint32_t(instr.time_ - last_move[lane]));
+                        }
+                        last_move[lane] = instr.time_;
+                    }
+                    if (close)
+                        warnings.push_back(arm_warning{arm_warning::kind::spacing, i, close, gap, string()});
+                } else if (!checked[instr.operand_]) {
+                    checked[instr.operand_] = true;
+                    const auto& path        = program_.string_at(instr.operand_);
+                    if (!(audioEngine_ ? audioEngine_->preload(path) : ifstream(path).good()))
+                        warnings.push_back(arm_warning{arm_warning::kind::audio, i, 0, 0, path});
+                }
+            }
+
+            prepare();
+            armed_ = true;
+            logging::info("Program armed, {} steps, {} warnings", program_.step_count(), warnings.size());
+            return warnings;
+        }
+
+        // Drops a prepared start, e.g. when the program changes.
+        void disarm()
+        {
+            if (!armed_)
                 return;
+            armed_ = false;
+            if (!is_executing()) {
+                stop_dispatch();
+                running_program_marker_ = nullptr;
+            }
+        }
+
+        // The program starts at `start`, which may be in the future. `received` is when the
+        // command arrived, to measure the time to the first step.
+        void start_program(clock_type::time_point start    = clock_type::now(),
+                           clock_type::time_point received = clock_type::now())
+        {
+            if (is_executing())
+                throw runtime_error("Executing");
+
+            if (program_.empty())
+                throw runtime_error("Empty");
+
+            if (!armed_)
+                prepare();
+            armed_          = false;
+            start_received_ = received;
+            measure_start_  = start <= clock_type::now();
+
+            logging::info("Started program with {} steps...", program_.step_count());
+            if (events_.active())
+                events_.publish("STARTED");
+            executing_ = true;
+            // May dispatch the first steps, and even end the program, before returning
+            on_dispatch([this, start] { scheduler_->start(start); });
+            publish_state();
+        }
+
+        // Sets up the scheduler and lights the program LED ahead of the start. Steps are fired
+        // ahead of their time by the lead of their action, but not before the start.
+        void prepare()
+        {
+            // The scheduler runs a copy, so edits meanwhile aren't made under the dispatch thread
+            unique_ptr<program::compiled_program> dispatched(new program::compiled_program(program_));
+            unique_ptr<fire_order> fire(new fire_order(*dispatched));
+            const size_t steps = dispatched->step_count();
+            first_offset_      = steps ? fire->at(0).offset_ : chrono::microseconds::zero();
+
+            // One extra step at the total time keeps the program running through trailing delays
+            running_program_marker_.reset(new running_program_marker());
+            const unsigned run = ++run_;
+            on_dispatch([&] {
+                dispatched_.swap(dispatched);
+                fire_.swap(fire);
+                scheduler_->prepare(
+                    steps + 1,
+                    [this, steps](size_t k) {
+                        return k < steps ? fire_->at(k).offset_
+                                         : chrono::microseconds(chrono::milliseconds(dispatched_->total_time()));
+                    },
+                    [this, steps, run](size_t k, clock_type::duration lateness) {
+                        if (k < steps)
+                            execute(fire_->at(k).step_, k == 0, lateness, run);
+                    },
+                    [this, run] {
+                        report([this, run] {
+                            if (run != run_)
+                                return;
+                            executing_              = false;
+                            running_program_marker_ = nullptr;
+                            publish_state();
+                            logging::info("Program ended!");
+                            if (events_.active())
+                                events_.publish("ENDED");
+                        });
+                    });
+            });
+        }
+
+        // Called on the dispatch thread, `run` is the run it belongs to.
+        void execute(const program::step& instr, bool first, clock_type::duration lateness, unsigned run)
+        {
+            step_lateness_.record(lateness);
+            if (first && measure_start_)
+                start_latency_.record(clock_type::now() - start_received_ - first_offset_);
+            report([this, instr, lateness, run] {
+                if (run != run_)
+                    return;
+                publish_state();
+                if (events_.active()) {
+                    // Step times are in seconds from program start
+                    auto actual =
+                        chrono::duration_cast<chrono::microseconds>(lateness).count() / 1e6 + instr.time_ / 1e3;
+                    stringstream msg;
+                    msg << fixed << setprecision(6) << "STEP," << instr.index_ << "," << instr.time_ / 1e3 << ","
+                        << actual;
+                    events_.publish(msg.str());
+                }
+            });
+
+            // Logged after the action, which shouldn't wait even for queuing the record
+            auto t_late = chrono::duration_cast<chrono::microseconds>(lateness).count();
+            try {
+                switch (instr.op_) {
+                case program::opcode::play_audio: {
+                    const auto& path = dispatched_->string_at(instr.operand_);
+                    play_audio(path);
+                    logging::info("T{} (+{} us): Playing audio file '{}'", instr.time_, t_late, path);
+                } break;
+
+                case program::opcode::move_target:
+                    if (target_control_)
+                        target_control_->move_target(instr.arg_ != 0, instr.operand_);
+                    logging::info("T{} (+{} us): Moving target to position '{}', lanes {}",
+                                  instr.time_,
+                                  t_late,
+                                  int(instr.arg_),
+                                  instr.operand_);
+                    break;
+
+                default:  // Steps are only actions
+                    break;
+                }
+            } catch (exception& e) {
+                logging::error("T{} (+{} us): {}", instr.time_, t_late, e.what());
+            }
+        }
+
+        // Called on the main thread only, as the single writer of state_.
+        void publish_state()
+        {
+            executor_state s{};
+            s.running_     = is_executing();
+            s.has_program_ = !program_.empty();
+            s.step_        = uint32_t(scheduler_->current_step());
+            s.total_time_  = program_.total_time();
+            if (target_control_) {
+                s.lane_count_ = uint8_t(target_control_->lane_count());
+                s.positions_  = target_control_->positions();
+            }
+            auto start    = scheduler_->start_time().time_since_epoch();
+            s.start_time_ = chrono::duration_cast<chrono::nanoseconds>(start).count();
+            state_.store(s);
+        }
+    };
+
+    // Commands that change program or target state, shared by the text, binary and HTTP front
+    // ends. Failures are returned; the front end has checked the controller lease already.
+    struct program_commands {
+        program_executor& executor_;
+
+        static uint32_t all_lanes() { return (1u << lanes_.size()) - 1; }
+
+        protocol::status clear()
+        {
+            executor_.clear_program();
+            logging::info("Program cleared!");
+            return protocol::status::ok;
+        }
+
+        // Every addition goes through edit(), as inside repeat blocks any of them may make the
+        // total time or step count too long, which the program throws for.
+        protocol::status advance(uint32_t ms)
+        {
+            return edit([&] { executor_.advance(ms); });
+        }
+
+        // Program structure, failing if it would be invalid or its total time too long.
+        protocol::status advance(const string& parameter)
+        {
+            return edit([&] { executor_.advance(parameter); });
+        }
+        protocol::status begin_repeat(uint32_t count)
+        {
+            return edit([&] { executor_.begin_repeat(count); });
+        }
+        protocol::status end_repeat()
+        {
+            return edit([&] { executor_.end_repeat(); });
+        }
+
+        // Sets a parameter of the program; the times that depend on it change with it.
+        protocol::status set_parameter(const string& name, uint32_t ms)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            return edit([&] { executor_.set_parameter(name, ms); });
+        }
+
+        protocol::status add_audio(const string& path)
+        {
+            if (path.empty())
+                return protocol::status::syntax;
+            // Decode now, so the step only has to trigger the mixer
+            if (audioEngine_)
+                audioEngine_->preload(path);
+            return edit([&] { executor_.add_audio(path); });
+        }
+
+        // Lanes is a bit mask, bit 0 being the first lane.
+        static bool valid_lanes(uint32_t lanes) { return lanes != 0 && !(lanes & ~all_lanes()); }
+
+        protocol::status add_move(bool position, uint32_t lanes)
+        {
+            if (!valid_lanes(lanes))
+                return protocol::status::syntax;
+            return edit([&] { executor_.add_move(position, uint16_t(lanes)); });
+        }
+
+        // Measures the audio lead with a clip, see program_executor::calibrate_audio().
+        protocol::status calibrate(const string& path)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            if (path.empty())
+                return protocol::status::syntax;
+            if (!audioEngine_ || !executor_.calibrate_audio(path))
+                return protocol::status::audio;
+            logging::info("Calibrating audio lead with '{}'", path);
+            return protocol::status::ok;
+        }
+
+        // Edits of the program by instruction index, see compiled_program::insert(). They would
+        // move the instructions under a running program, so not while it runs.
+        protocol::status insert(size_t index, const program::instruction& instr)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            return edit([&] { executor_.insert(index, instr); });
+        }
+        protocol::status replace(size_t index, const program::instruction& instr)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            return edit([&] { executor_.replace(index, instr); });
+        }
+        protocol::status erase(size_t index)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            return edit([&] { executor_.erase(index); });
+        }
+        protocol::status shift(size_t index, int64_t ms)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            return edit([&] { executor_.shift(index, ms); });
+        }
+
+        // The instruction a T, A, M, [ or ] command adds, for the edits. Throws if invalid.
+        program::instruction audio_step(const string& path)
+        {
+            if (path.empty())
+                throw runtime_error("Syntax");
+            if (audioEngine_)
+                audioEngine_->preload(path);
+            return executor_.program_.make_audio(path);
+        }
+
+        template <typename Edit>
+        static protocol::status edit(Edit&& e)
+        {
+            try {
+                e();
+            } catch (runtime_error&) {
+                return protocol::status::syntax;
+            }
+            return protocol::status::ok;
+        }
+
+        protocol::status play(const string& path)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            if (path.empty())
+                return protocol::status::syntax;
+            logging::info("Playing audio file '{}' directly", path);
+            executor_.play_audio(path);
+            return protocol::status::ok;
+        }
+
+        protocol::status move(bool position, uint32_t lanes)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            if (!executor_.target_control_)
+                return protocol::status::target;
+            if (lanes == 0 || (lanes & ~all_lanes()))
+                return protocol::status::syntax;
+            logging::info("Moving target to position '{}', lanes {}", int(position), lanes);
+            executor_.target_control_->move_target(position, lanes);
+            return protocol::status::ok;
+        }
+
+        // Arms the program, see program_executor::arm_program().
+        protocol::status arm(vector<arm_warning>& warnings)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            if (executor_.program_.empty())
+                return protocol::status::empty;
+            warnings = executor_.arm_program();
+            return protocol::status::ok;
+        }
+
+        // `received` is when the command arrived.
+        protocol::status run(program_executor::clock_type::time_point received)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            if (executor_.program_.empty())
+                return protocol::status::empty;
+            executor_.start_program(program_executor::clock_type::now(), received);
+            return protocol::status::ok;
+        }
+
+        // Runs the program at `start_us` of the shared timebase.
+        protocol::status run_at(int64_t start_us)
+        {
+            if (clockSync_ && !clockSync_->synchronized())
+                return protocol::status::clock;
+            const auto now   = program_executor::clock_type::now();
+            const auto delay = chrono::microseconds(start_us - shared_time_us());
+            if (delay < chrono::microseconds::zero())
+                return protocol::status::late;
+            if (delay > chrono::hours(24))
+                return protocol::status::syntax;
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            if (executor_.program_.empty())
+                return protocol::status::empty;
+            logging::info("Program starts in {} us", delay.count());
+            executor_.start_program(now + delay);
+            return protocol::status::ok;
+        }
+
+        // Replaces the program, which is already validated.
+        protocol::status load(program::compiled_program&& p)
+        {
+            if (executor_.is_executing())
+                return protocol::status::executing;
+            executor_.load_program(std::move(p));
+            return protocol::status::ok;
+        }
+
+        protocol::status stop()
+        {
+            executor_.stop_program();
+            return protocol::status::ok;
+        }
+    };
+
+    // What a simulated program does, one line per action with its time from the program start:
+    // its events as for E, GPIO pin changes and audio started.
+    struct simulation_trace : event_subscriber {
+        ostream& out_;
+        timing::clock::time_point start_{timing::clock::now()};
+
+        explicit simulation_trace(ostream& out) : out_(out) {}
+
+        void line(const string& what)
+        {
+            auto t = chrono::duration_cast<chrono::microseconds>(timing::clock::now() - start_).count();
+            stringstream msg;
+            msg << fixed << setprecision(6) << t / 1e6 << "," << what << "\n";
+            out_ << msg.str();
+        }
+        void send_event(event_message& e) override { line(e.what_); }
+    };
+
+    // Runs a program in virtual time, as fast as the CPU allows and without driving the GPIO or
+    // playing audio, and writes its trace. Virtual time must have been switched on.
+    void simulate_program(const program::compiled_program& p, ostream& out)
+    {
+        asio::io_context io_context;
+        auto* backend = new gpio::simulated_backend;
+        program_executor executor(io_context, unique_ptr<gpio::backend>(backend));
+        simulation_trace trace(out);
+        backend->on_write_ = [&trace](unsigned pin, bool level) {
+            trace.line("GPIO," + to_string(pin) + (level ? ",1" : ",0"));
+        };
+        executor.on_audio_ = [&trace](const string& path) { trace.line("AUDIO," + path); };
+        executor.events_.subscribe(&trace);
+
+        executor.load_program(program::compiled_program(p));
+        trace.start_ = timing::clock::now();
+        executor.start_program(trace.start_, trace.start_);
+        // Runs until the last target has settled, after the program ended
+        timing::run_virtual(io_context);
+        executor.events_.unsubscribe(&trace);
+        backend->on_write_ = nullptr;
+    }
+
+    // Simulates the library program `key`, by name or "#<hash>", or all of them for "*".
+    // Returns the exit code, 1 if a program isn't found or can't run.
+    int simulate_library(const string& key)
+    {
+        vector<library::store::entry> entries;
+        if (key == "*")
+            entries = library_->list();
+        else {
+            program::compiled_program p;
+            if (!library_->get(key, p)) {
+                logging::error("Unknown program '{}'", key);
+                return 1;
+            }
+            library::store::entry e{};
+            e.hash_       = p.hash();
+            e.total_time_ = p.total_time();
+            e.steps_      = p.step_count();
+            if (key.compare(0, 1, "#") != 0)
+                key.copy(e.name_, min(key.size(), sizeof e.name_ - 1));
+            entries.push_back(e);
+        }
+
+        int result = 0;
+        for (const auto& e : entries) {
+            program::compiled_program p;
+            library_->get("#" + library::to_hex(e.hash_), p);
+            cout << "PROGRAM=" << library::to_hex(e.hash_) << "," << e.total_time_ / 1000.0 << "," << e.steps_ << ","
+                 << e.name_ << "\n";
+            try {
+                simulate_program(p, cout);
+            } catch (exception& ex) {
+                cout << "ERROR=" << ex.what() << "\n";
+                result = 1;
+            }
+        }
+        cout << flush;
+        return result;
+    }
+
+    // Hands out the controller lease and closes idle sessions from a single watchdog timer.
+    struct session_registry {
+        using clock_type = timing::clock;
+
+        timing::timer watchdog_;
+        timing::timer grace_timer_;
+        set<session*> sessions_;
+        session* controller_{};
+        string token_;     // Resume token of the current lease, empty if not leased
+        bool reserved_{};  // Lease kept for token_ while no session holds it
+
+        typedef function<void(bool)> on_lease_type;
+        on_lease_type on_lease_;  // Called with true when the lease is taken, false when released
+
+        session_registry(asio::io_context& io_context, on_lease_type on_lease)
+            : watchdog_(io_context), grace_timer_(io_context), on_lease_(on_lease)
+        {
+        }
+
+        void add(session* s);
+        void remove(session* s);
+        bool acquire(session* s);
+        // Takes over the lease given its token, from a stale session or while the lease is
+        // reserved after a disconnect.
+        bool resume(session* s, const string& token);
+        const string& token() const { return token_; }
+        // Whether a request carrying `token` may act for the lease holder. Anyone may while
+        // the lease is free.
+        bool may_control(const string& token) const { return token_.empty() || token == token_; }
+
+        size_t size() const { return sessions_.size(); }
+        bool is_controller(const session* s) const { return controller_ == s; }
+
+        void arm_watchdog();
+        void check_idle();
+    };
+
+    struct session : enable_shared_from_this<session>, event_subscriber {
+        using clock_type = session_registry::clock_type;
+
+        tcp::socket socket_;
+        enum { max_length = 1024 };
+        enum { max_pending_write = 256 * 1024 };    // Reading pauses while more than this is unsent
+        enum { max_pending_events = 1024 * 1024 };  // A subscriber is closed past this much unsent
+        array<char, max_length> read_buffer_;
+        protocol::command_parser parser_;
+        protocol::binary::frame_parser frames_;
+        bool received_{};  // Anything read yet, the protocol is chosen by the first bytes
+        bool binary_{};
+        bool reading_{};
+        bool stop_reading_{};
+        bool subscribed_{};  // Receiving events, the session stays open however long it is idle
+        clock_type::time_point last_activity_{clock_type::now()};
+
+        // The line being received, which is answered as a whole when its newline arrives
+        string batch_reply_;
+        size_t batch_commands_{};
+        bool batch_failed_{};
+
+        deque<string> write_queue_;  // Replies in order, front ones may be in flight
+        size_t writing_{};           // Number of replies in the current async_write
+        size_t pending_bytes_{};
+        vector<asio::const_buffer> write_buffers_;
+
+        program_executor& executor_;
+        program_commands commands_;
+        session_registry& registry_;
+
+        session(tcp::socket socket, program_executor& executor, session_registry& registry)
+            : socket_(move(socket)), executor_(executor), commands_{executor}, registry_(registry)
+        {
+            logging::info("Session started");
+            registry_.add(this);
+        }
+        ~session()
+        {
+            executor_.events_.unsubscribe(this);
+            registry_.remove(this);
+            logging::info("Session stopped");
+        }
+
+        void start()
+        {
+            // Replies are small and latency bound, don't let Nagle hold them back
+            asio::error_code ignored;
+            socket_.set_option(tcp::no_delay(true), ignored);
+            do_read();
+        }
+
+        // Called by the registry watchdog.
+        void close()
+        {
+            asio::error_code ignored;
+            socket_.close(ignored);
+        }
+
+        // Takes the controller lease, or resumes it with its token.
+        protocol::status lease(const string& token)
+        {
+            if (!registry_.resume(this, token) && !registry_.acquire(this))
+                return protocol::status::busy;
+            return protocol::status::ok;
+        }
+
+        void subscribe(bool on)
+        {
+            subscribed_ = on;
+            if (on)
+                executor_.events_.subscribe(this);
+            else
+                executor_.events_.unsubscribe(this);
+        }
+
+        static void check(protocol::status s)
+        {
+            if (s != protocol::status::ok)
+                throw runtime_error(protocol::to_string(s));
+        }
+
+        // A number converted to ms or us, throws Syntax unless within [min, max] so the
+        // conversion to an integer is defined.
+        static int64_t checked_integer(double value, int64_t min, int64_t max)
+        {
+            if (!(value >= double(min) && value <= double(max)))
+                throw runtime_error("Syntax");
+            return int64_t(value);
+        }
+
+        static size_t parse_index(protocol::slice arg)
+        {
+            const auto index = arg.to_int();
+            if (index < 0)
+                throw runtime_error("Syntax");
+            return size_t(index);
+        }
+
+        // The instruction of a T, A, M, [ or ] command, for the edit commands.
+        program::instruction parse_step(protocol::slice s)
+        {
+            if (s.empty())
+                throw runtime_error("Syntax");
+            switch (s.front()) {
+            case 'T': {
+                auto arg = s.substr(1).trim();
+                if (!arg.empty() && arg.front() == '$')
+                    return executor_.program_.make_wait(arg.substr(1).str());
+                auto ms = checked_integer(arg.to_float() * 1000, 0, INT32_MAX);
+                return program::compiled_program::make_wait(uint32_t(ms));
+            }
+            case 'A':
+                return commands_.audio_step(s.substr(1).trim().str());
+            case 'M': {
+                auto arg = parse_move(s.substr(1));
+                if (!program_commands::valid_lanes(arg.second))
+                    throw runtime_error("Syntax");
+                return program::compiled_program::make_move(arg.first, uint16_t(arg.second));
+            }
+            case '[': {
+                auto count = s.substr(1).to_int();
+                if (count <= 0)
+                    throw runtime_error("Syntax");
+                return program::compiled_program::make_repeat(uint32_t(count));
+            }
+            case ']':
+                return program::compiled_program::make_end();
+            default:
+                throw runtime_error("Syntax");
+            }
+        }
+
+        // "<pos>[,<lanes>]" where lanes is a bit mask, decimal or 0x hex, all lanes if not given.
+        static pair<bool, uint32_t> parse_move(protocol::slice arg)
+        {
+            const auto comma = arg.find(',');
+            const bool pos   = arg.substr(0, comma).to_int() != 0;
+            if (comma == arg.size())
+                return make_pair(pos, program_commands::all_lanes());
+            const auto lanes = arg.substr(comma + 1).trim();
+            const char* p    = lanes.begin();
+            if (lanes.size() > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+                return make_pair(pos, uint32_t(lanes.substr(2).to_int(16)));
+            return make_pair(pos, uint32_t(lanes.to_int()));
+        }
+
+        // Position of the single lane, or of each lane separated by comma.
+        static string format_positions(const executor_state& state)
+        {
+            string s;
+            for (size_t i = 0; i < state.lane_count_; ++i) {
+                if (i)
+                    s += ',';
+                s += ((state.positions_ >> i) & 1) ? '1' : '0';
+            }
+            return s;
+        }
+
+        string query_state() const
+        {
+            const auto state = executor_.state_.load();
+
+            // Seconds into the running program, not given before a scheduled start
+            double t_exec = -1.0;
+            if (state.running_) {
+                auto start = program_executor::clock_type::time_point(chrono::nanoseconds(state.start_time_));
+                auto t     = chrono::duration_cast<chrono::milliseconds>(program_executor::clock_type::now() - start);
+                t_exec     = t.count() / 1000.0;
+            }
+
+            stringstream msg;
+            msg << "EXEC=" << (t_exec >= 0 ? to_string(t_exec) : "") << "\r\n"
+                << "PROG=" << (state.has_program_ ? to_string(state.total_time_ / 1000.0) : "") << "\r\n"
+                << "POS=" << format_positions(state) << "\r\n";
+            return msg.str();
+        }
+
+        // Commands that change program or target state need the controller lease.
+        static bool changes_state(char command) { return command != '\0' && strchr("CTAMPDRVSWGU$[]+=->", command); }
+        static bool changes_state(protocol::binary::opcode op)
+        {
+            return (op >= protocol::binary::opcode::clear && op <= protocol::binary::opcode::stop) ||
+                   (op >= protocol::binary::opcode::arm && op <= protocol::binary::opcode::shift);
+        }
+
+        string parse_command(protocol::slice s)
+        {
+            try {
+                if (changes_state(s.front()) && !registry_.is_controller(this))
+                    throw runtime_error("Busy");
+
+                switch (s.front()) {
+                case 'C':  // Clear program
+                    check(commands_.clear());
+                    break;
+
+                case 'T': {
+                    auto arg = s.substr(1).trim();
+                    if (!arg.empty() && arg.front() == '$') {
+                        check(commands_.advance(arg.substr(1).str()));
+                        break;
+                    }
+                    auto ms = checked_integer(arg.to_float() * 1000, 0, INT32_MAX);
+                    check(commands_.advance(uint32_t(ms)));
+                } break;
+
+                case '$':  // Set a parameter: $<name>=<seconds>
+                {
+                    const auto equals = s.find('=');
+                    if (equals == s.size())
+                        throw runtime_error("Syntax");
+                    auto ms = checked_integer(s.substr(equals + 1).to_float() * 1000, 0, INT32_MAX);
+                    check(commands_.set_parameter(s.substr(1, equals - 1).trim().str(), uint32_t(ms)));
+                } break;
+
+                case '[':  // Begin a block repeated <count> times
+                {
+                    auto count = s.substr(1).to_int();
+                    if (count <= 0)
+                        throw runtime_error("Syntax");
+                    check(commands_.begin_repeat(uint32_t(count)));
+                } break;
+
+                case ']':  // End the innermost block
+                    check(commands_.end_repeat());
+                    break;
+
+                case '+':  // Insert a command before the instruction at <index>: +<index>,<command>
+                case '=':  // Replace the instruction at <index> by a command: =<index>,<command>
+                {
+                    const auto comma = s.find(',');
+                    const auto index = parse_index(s.substr(1, comma - 1));
+                    const auto instr = parse_step(s.substr(comma + 1).trim());
+                    check(s.front() == '+' ? commands_.insert(index, instr) : commands_.replace(index, instr));
+                } break;
+
+                case '-':  // Delete the instruction at <index>
+                    check(commands_.erase(parse_index(s.substr(1))));
+                    break;
+
+                case '>':  // Delay the instruction at <index> and those after it: ><index>,<seconds>
+                {
+                    const auto comma = s.find(',');
+                    const auto ms    = s.substr(comma + 1).to_double() * 1000;
+                    check(commands_.shift(parse_index(s.substr(1, comma - 1)),
+                                          checked_integer(ms, -int64_t(UINT32_MAX), UINT32_MAX)));
+                } break;
+
+                case 'A':  // Play audio
+                    check(commands_.add_audio(s.substr(1).trim().str()));
+                    break;
+
+                case 'M':  // Move target
+                {
+                    auto arg = parse_move(s.substr(1));
+                    check(commands_.add_move(arg.first, arg.second));
+                } break;
+
+                case 'P':  // Play audio file directly
+                    check(commands_.play(s.substr(1).trim().str()));
+                    break;
+
+                case 'D':  // Move target directly
+                {
+                    auto arg = parse_move(s.substr(1));
+                    check(commands_.move(arg.first, arg.second));
+                } break;
+
+                case 'R':  // Run program, now or at a time of the shared timebase
+                    if (s.size() == 1)
+                        check(commands_.run(last_activity_));
+                    else
+                        check(commands_.run_at(checked_integer(s.substr(1).to_double() * 1e6, 0, int64_t(1) << 62)));
+                    break;
+
+                case 'V':  // Validate and arm the program, so R starts it at once
+                {
+                    vector<arm_warning> warnings;
+                    check(commands_.arm(warnings));
+                    stringstream msg;
+                    msg << "ARMED=" << executor_.program_.step_count() << "," << warnings.size() << "\r\n";
+                    for (const auto& w : warnings) {
+                        if (w.kind_ == arm_warning::kind::spacing)
+                            msg << "WARNING=Spacing," << w.step_ << "," << w.lanes_ << "," << w.gap_ms_ / 1000.0
+                                << "\r\n";
+                        else
+                            msg << "WARNING=Audio," << w.step_ << "," << w.path_ << "\r\n";
+                    }
+                    return msg.str();
+                } break;
+
+                case 'K':  // Lead of audio and move steps, or calibrate the audio lead with a file
+                    if (s.size() > 1) {
+                        if (!registry_.is_controller(this))
+                            throw runtime_error("Busy");
+                        check(commands_.calibrate(s.substr(1).trim().str()));
+                    } else {
+                        stringstream msg;
+                        msg << fixed << setprecision(6) << "LEAD=" << audioLead_.count() / 1e6 << ","
+                            << moveLead_.count() / 1e6 << "\r\n";
+                        return msg.str();
+                    }
+                    break;
+
+                case 'O':  // Time of the shared timebase, clock offset and its error
+                {
+                    stringstream msg;
+                    msg << fixed << setprecision(6) << "CLOCK=" << shared_time_us() / 1e6 << ",";
+                    if (!clockSync_)
+                        msg << 0.0 << "," << 0.0;
+                    else if (clockSync_->synchronized())
+                        msg << clockSync_->offset().count() / 1e6 << "," << clockSync_->error().count() / 1e6;
+                    else
+                        msg << ",";
+                    msg << "\r\n";
+                    return msg.str();
+                } break;
+
+                case 'S':  // Stop program
+                    check(commands_.stop());
+                    break;
+
+                case 'W':  // Store the current program in the library, by name if given
+                {
+                    if (!library_)
+                        throw runtime_error("Library");
+                    if (executor_.program_.empty())
+                        throw runtime_error("Empty");
+                    auto hash = library_->put(s.substr(1).trim().str(), executor_.program_);
+                    logging::info("Program stored as {}", library::to_hex(hash));
+                    return "HASH=" + library::to_hex(hash) + "\r\n";
+                } break;
+
+                case 'G':  // Get a program from the library, by name or #hash
+                case 'U':  // Get a program from the library and run it
+                {
+                    if (!library_)
+                        throw runtime_error("Library");
+                    program::compiled_program p;
+                    if (!library_->get(s.substr(1).trim().str(), p))
+                        throw runtime_error("UnknownProgram");
+                    auto hash = p.hash();
+                    check(commands_.load(move(p)));
+                    logging::info("Program {} loaded", library::to_hex(hash));
+                    if (s.front() == 'U')
+                        check(commands_.run(last_activity_));
+                    return "HASH=" + library::to_hex(hash) + "\r\n";
+                } break;
+
+                case 'I':  // List the library
+                {
+                    if (!library_)
+                        throw runtime_error("Library");
+                    auto entries = library_->list();
+                    stringstream msg;
+                    msg << "PROGRAMS=" << entries.size() << "\r\n";
+                    for (const auto& e : entries) {
+                        msg << "PROGRAM=" << library::to_hex(e.hash_) << "," << e.total_time_ / 1000.0 << ","
+                            << e.steps_ << "," << string(e.name_, strnlen(e.name_, sizeof(e.name_))) << "\r\n";
+                    }
+                    return msg.str();
+                } break;
+
+                case 'E':  // Subscribe to (E or E1) or unsubscribe from (E0) events
+                    subscribe(s.size() == 1 || s.substr(1).to_int() != 0);
+                    break;
+
+                case 'H':  // Latency histograms in us, reset after being reported
+                {
+                    stringstream msg;
+                    msg << "STEP=" << metrics::to_string(executor_.step_lateness_.take()) << "\r\n"
+                        << "GPIO="
+                        << (executor_.target_control_
+                                ? metrics::to_string(executor_.target_control_->move_latency_.take())
+                                : "")
+                        << "\r\n"
+                        << "AUDIO=" << metrics::to_string(audioLatency_.take()) << "\r\n"
+                        << "START=" << metrics::to_string(executor_.start_latency_.take()) << "\r\n";
+                    return msg.str();
+                } break;
+
+                case 'L':  // Take the controller lease, or resume it with its token
+                    check(lease(s.substr(1).trim().str()));
+                    return "TOKEN=" + registry_.token() + "\r\n" + query_state();
+
+                case 'Q':  // Query state
+                    return query_state();
+
+                case 'X':  // Exit, will disconnect the session immediately
+                    throw client_exit();
+
+                default:
+                    throw runtime_error("UnknownCommand");
+                }
+
+                return move(string{});
+            } catch (runtime_error& e) {
+                throw e;
+            } catch (const exception&) {
+                throw runtime_error("Syntax");
+            }
+        }
+
+        protocol::binary::state binary_state() const
+        {
+            const auto state = executor_.state_.load();
+            protocol::binary::state b{};
+            b.exec_ms_ = -1;
+            if (state.running_) {
+                auto start = program_executor::clock_type::time_point(chrono::nanoseconds(state.start_time_));
+                auto t     = chrono::duration_cast<chrono::milliseconds>(program_executor::clock_type::now() - start);
+                if (t.count() >= 0)
+                    b.exec_ms_ = int32_t(t.count());
+            }
+            b.total_ms_  = state.total_time_;
+            b.positions_ = state.positions_;
+            b.step_      = state.step_;
+            b.lanes_     = state.lane_count_;
+            b.flags_     = uint8_t((state.running_ ? protocol::binary::state::running : 0) |
+                                   (state.has_program_ ? protocol::binary::state::has_program : 0));
+            return b;
+        }
+
+        // Answers one binary request by appending its reply frame to `reply`.
+        // The instruction of a program frame, for insert and replace. False if invalid.
+        bool binary_step(protocol::binary::opcode op, protocol::slice payload, program::instruction& instr)
+        {
+            using protocol::binary::opcode;
+            const char* p = payload.begin();
+            try {
+                switch (op) {
+                case opcode::advance:
+                    if (payload.size() != 4)
+                        return false;
+                    instr = program::compiled_program::make_wait(protocol::binary::get_u32(p));
+                    return true;
+                case opcode::add_audio:
+                    instr = commands_.audio_step(payload.str());
+                    return true;
+                case opcode::add_move: {
+                    if (payload.size() != 4)
+                        return false;
+                    uint32_t lanes = protocol::binary::get_u16(p + 2);
+                    if (lanes == 0)
+                        lanes = program_commands::all_lanes();
+                    if (!program_commands::valid_lanes(lanes))
+                        return false;
+                    instr = program::compiled_program::make_move(p[0] != 0, uint16_t(lanes));
+                    return true;
+                }
+                case opcode::repeat:
+                    if (payload.size() != 4)
+                        return false;
+                    instr = program::compiled_program::make_repeat(protocol::binary::get_u32(p));
+                    return true;
+                case opcode::end:
+                    instr = program::compiled_program::make_end();
+                    return true;
+                case opcode::wait:
+                    instr = executor_.program_.make_wait(payload.str());
+                    return true;
+                default:
+                    return false;
+                }
+            } catch (runtime_error&) {
+                return false;
+            }
+        }
+
+        void handle_frame(const protocol::binary::header& h, protocol::slice payload, string& reply)
+        {
+            using protocol::binary::opcode;
+            using protocol::status;
+            if (changes_state(h.opcode_) && !registry_.is_controller(this)) {
+                protocol::binary::encode(reply, h.opcode_, status::busy, h.tag_, "", 0);
+                return;
+            }
+
+            const char* p = payload.begin();
+            auto st       = status::ok;
+            string out;
+            switch (h.opcode_) {
+            case opcode::hello:
+                out.push_back(char(protocol::binary::version));
+                break;
+            case opcode::clear:
+                st = commands_.clear();
+                break;
+            case opcode::advance:
+                st = payload.size() == 4 ? commands_.advance(protocol::binary::get_u32(p)) : status::syntax;
+                break;
+            case opcode::add_audio:
+                st = commands_.add_audio(payload.str());
+                break;
+            case opcode::add_move:
+            case opcode::move: {
+                if (payload.size() != 4) {
+                    st = status::syntax;
+                    break;
+                }
+                const bool position = p[0] != 0;
+                uint32_t lanes      = protocol::binary::get_u16(p + 2);
+                if (lanes == 0)
+                    lanes = program_commands::all_lanes();
+                st = h.opcode_ == opcode::add_move ? commands_.add_move(position, lanes)
+                                                   : commands_.move(position, lanes);
+            } break;
+            case opcode::play:
+                st = commands_.play(payload.str());
+                break;
+            case opcode::run:
+                if (payload.empty())
+                    st = commands_.run(last_activity_);
+                else if (payload.size() == 8)
+                    st = commands_.run_at(int64_t(protocol::binary::get_u64(p)));
+                else
+                    st = status::syntax;
+                break;
+            case opcode::stop:
+                st = commands_.stop();
+                break;
+            case opcode::arm: {
+                vector<arm_warning> warnings;
+                st = commands_.arm(warnings);
+                uint16_t spacing = 0, audio = 0;
+                for (const auto& w : warnings)
+                    ++(w.kind_ == arm_warning::kind::spacing ? spacing : audio);
+                protocol::binary::put_u16(out, spacing);
+                protocol::binary::put_u16(out, audio);
+            } break;
+            case opcode::repeat:
+                st = payload.size() == 4 && protocol::binary::get_u32(p) > 0
+                         ? commands_.begin_repeat(protocol::binary::get_u32(p))
+                         : status::syntax;
+                break;
+            case opcode::end:
+                st = commands_.end_repeat();
+                break;
+            case opcode::parameter:
+                st = payload.size() > 4 ? commands_.set_parameter(payload.substr(4).str(), protocol::binary::get_u32(p))
+                                        : status::syntax;
+                break;
+            case opcode::wait:
+                st = commands_.advance(payload.str());
+                break;
+            case opcode::insert:
+            case opcode::replace: {
+                program::instruction instr;
+                if (payload.size() < 5 || !binary_step(opcode(p[4]), payload.substr(5), instr)) {
+                    st = status::syntax;
+                    break;
+                }
+                const auto index = protocol::binary::get_u32(p);
+                st = h.opcode_ == opcode::insert ? commands_.insert(index, instr) : commands_.replace(index, instr);
+            } break;
+            case opcode::erase:
+                st = payload.size() == 4 ? commands_.erase(protocol::binary::get_u32(p)) : status::syntax;
+                break;
+            case opcode::shift:
+                st = payload.size() == 8
+                         ? commands_.shift(protocol::binary::get_u32(p), int32_t(protocol::binary::get_u32(p + 4)))
+                         : status::syntax;
+                break;
+            case opcode::query:
+                protocol::binary::encode_state(out, binary_state());
+                break;
+            case opcode::lease:
+                st = lease(payload.str());
+                if (st == status::ok) {
+                    out = registry_.token();
+                    out.resize(16, '\0');
+                    protocol::binary::encode_state(out, binary_state());
+                }
+                break;
+            case opcode::subscribe:
+                subscribe(payload.empty() || p[0] != 0);
+                break;
+            case opcode::exit:
+                // Answered, then the session ends when the reply is flushed
+                stop_reading_ = true;
+                break;
+            default:
+                st = status::unknown_command;
+                break;
+            }
+            protocol::binary::encode(reply, h.opcode_, st, h.tag_, out.data(), out.size());
+        }
+
+        // Replies to all complete frames of a read with one send. Returns false to end the
+        // session, if the stream is malformed or the client asked to exit.
+        bool read_frames(size_t length)
+        {
+            string reply;
+            auto on_frame = [&](const protocol::binary::header& h, protocol::slice payload) {
+                if (stop_reading_)
+                    return;
+                // A failure that got past the command still only fails this request
+                try {
+                    handle_frame(h, payload, reply);
+                } catch (const runtime_error&) {
+                    protocol::binary::encode(reply, h.opcode_, protocol::status::syntax, h.tag_, "", 0);
+                }
+            };
+            if (!frames_.feed(read_buffer_.data(), length, on_frame)) {
+                logging::warning("Malformed binary stream, closing session");
+                stop_reading_ = true;
+            }
+            if (!reply.empty())
+                send(move(reply));
+            return !stop_reading_;
+        }
+
+        void do_read()
+        {
+            auto self = shared_from_this();
+            reading_  = true;
+            socket_.async_read_some(asio::buffer(read_buffer_), [this, self](error_code ec, size_t length) {
+                reading_ = false;
+                if (!ec) {
+                    last_activity_ = clock_type::now();
+
+                    // The binary protocol is chosen by its magic in place of the first command
+                    if (!received_ && length > 0 && read_buffer_[0] == protocol::binary::magic[0]) {
+                        logging::info("Session uses the binary protocol");
+                        binary_ = true;
+                    }
+                    received_ = true;
+                    if (binary_) {
+                        if (read_frames(length) && pending_bytes_ <= max_pending_write)
+                            do_read();
+                        return;
+                    }
 
-            if (level != 0)  // If not change to low
-                return;
+                    // The commands of a line are answered with one reply when its newline
+                    // arrives, however the line was split into reads. After an error the rest
+                    // of the line is skipped, as the program is then incomplete.
+                    auto fail = [&](const char* error) {
+                        batch_reply_  = string("ERROR=") + error + "\r\n";
+                        batch_failed_ = true;
+                    };
+                    try {
+                        parser_.feed(read_buffer_.data(),
+                                     length,
+                                     [&](protocol::slice cmd) {
+                                         ++batch_commands_;
+                                         if (batch_failed_)
+                                             return;
+                                         try {
+                                             batch_reply_ += parse_command(cmd);
+                                         } catch (const runtime_error& e) {
+                                             fail(e.what());
+                                         }
+                                     },
+                                     [&] {
+                                         ++batch_commands_;
+                                         if (!batch_failed_)
+                                             fail("Syntax");
+                                     },
+                                     [&] {
+                                         if (batch_commands_ != 0)
+                                             send(batch_reply_.empty() ? string("OK\r\n") : move(batch_reply_));
+                                         batch_reply_.clear();
+                                         batch_commands_ = 0;
+                                         batch_failed_   = false;
+                                     });
+                    } catch (const client_exit&) {
+                        // Stop reading, the session ends when queued replies are flushed
+                        stop_reading_ = true;
+                        return;
+                    }
 
-            ((button_handler*)userdata)->on_button();
+                    // Keep reading while replies are flushed, unless the client doesn't read them
+                    if (pending_bytes_ <= max_pending_write)
+                        do_read();
+                } else
+                    stop_reading_ = true;
+            });
         }
 
-        button_handler()
+        // Sends an event in the protocol of the session. A subscriber that doesn't read its
+        // events is closed rather than have them pile up.
+        void send_event(event_message& e) override
         {
-            try {
-                target_control_.reset(new target_control());
-                gpioSetAlertFuncEx(GPIO::BUTTON, eventFuncEx, this);
-            } catch (exception& e) {
-                cerr << "Exception: " << e.what() << endl;
+            if (!socket_.is_open())
+                return;
+            if (pending_bytes_ > max_pending_events) {
+                logging::warning("Subscriber doesn't read events, session closed");
+                close();
+                return;
             }
+            send(binary_ ? e.frame() : e.line());
         }
-        ~button_handler() { gpioSetAlertFuncEx(GPIO::BUTTON, NULL, NULL); }
-
-        void on_button() { button_job_ = target_control_->move_target(!target_control_->position()); }
-    };
 
-#else
-    // Dummy implementations
-    struct server_ready_marker {
-    };
-    struct session_active_marker {
-    };
-    struct running_program_marker {
-    };
-    struct target_control {
-        atomic<bool> position_{};
+        // Queues a reply, replies are written in the order they are sent.
+        void send(string msg)
+        {
+            pending_bytes_ += msg.size();
+            write_queue_.push_back(move(msg));
+            if (writing_ == 0)
+                do_write();
+        }
 
-        future<void> move_target(bool toFront)
+        void do_write()
         {
-            return async(launch::async, [this, toFront]() mutable {
-                position_ = toFront;
-                this_thread::sleep_for(chrono::milliseconds(500));
+            // Gather everything queued so far into one write
+            write_buffers_.clear();
+            for (const auto& msg : write_queue_)
+                write_buffers_.push_back(asio::buffer(msg));
+            writing_ = write_queue_.size();
+
+            auto self = shared_from_this();
+            asio::async_write(socket_, write_buffers_, [this, self](error_code ec, size_t length) {
+                if (ec) {
+                    close();
+                    return;
+                }
+                write_queue_.erase(write_queue_.begin(), write_queue_.begin() + writing_);
+                pending_bytes_ -= length;
+                writing_ = 0;
+                if (!write_queue_.empty())
+                    do_write();
+                if (!reading_ && !stop_reading_ && pending_bytes_ <= max_pending_write)
+                    do_read();
             });
         }
-
-        bool position() const { return position_; }
     };
 
-    struct button_handler {
-    };
-#endif
+    void session_registry::add(session* s)
+    {
+        sessions_.insert(s);
+        if (!controller_)
+            acquire(s);
+        if (sessions_.size() == 1)
+            arm_watchdog();
+    }
 
-    struct session : enable_shared_from_this<session> {
-        using clock_type = chrono::high_resolution_clock;
+    void session_registry::remove(session* s)
+    {
+        sessions_.erase(s);
+        if (controller_ == s) {
+            controller_ = nullptr;
+            if (disconnectPolicy_ == disconnect_policy::keep_running && resumeGrace_ > 0) {
+                logging::info("Lease kept for {} s", resumeGrace_);
+                reserved_ = true;
+                grace_timer_.expires_after(chrono::seconds(resumeGrace_));
+                grace_timer_.async_wait([this](error_code ec) {
+                    if (ec || !reserved_)
+                        return;
+                    reserved_ = false;
+                    token_.clear();
+                    on_lease_(false);
+                });
+            } else {
+                token_.clear();
+                on_lease_(false);
+            }
+        }
+        if (sessions_.empty())
+            watchdog_.cancel();
+    }
 
-        tcp::socket socket_;
-        asio::steady_timer timer_;
-        enum { max_length = 1024 };
-        array<char, max_length> data_;
+    bool session_registry::acquire(session* s)
+    {
+        if ((controller_ && controller_ != s) || reserved_)
+            return false;
+        if (!controller_) {
+            static mt19937_64 generator{random_device{}()};
+            stringstream token;
+            token << hex << setfill('0') << setw(16) << generator();
+            controller_ = s;
+            token_      = token.str();
+            on_lease_(true);
+        }
+        return true;
+    }
 
-        struct step {
-            chrono::milliseconds time_to_execute_;
-            function<void()> fn_;
-            step(chrono::milliseconds t, function<void()> fn) : time_to_execute_(t), fn_(fn) {}
-        };
+    bool session_registry::resume(session* s, const string& token)
+    {
+        if (token_.empty() || token != token_)
+            return false;
+        if (controller_ && controller_ != s) {
+            // The old connection is likely half open after a dropout, it can't be trusted
+            logging::info("Lease resumed from a stale session");
+            controller_->close();
+        } else if (reserved_) {
+            logging::info("Lease resumed");
+            reserved_ = false;
+            grace_timer_.cancel();
+        }
+        controller_ = s;
+        return true;
+    }
+
+    void session_registry::arm_watchdog()
+    {
+        if (sessionTimeout_ <= 0)
+            return;
+        watchdog_.expires_after(chrono::seconds(1));
+        watchdog_.async_wait([this](error_code ec) {
+            if (ec)
+                return;
+            check_idle();
+            if (!sessions_.empty())
+                arm_watchdog();
+        });
+    }
 
-        vector<step> program_;
-        mutex mutex_;
-        bool stop_flag_{};
-        condition_variable cv_;
-        future<void> programJob_;
-        clock_type::time_point programStartTime_;
+    void session_registry::check_idle()
+    {
+        auto deadline = clock_type::now() - chrono::seconds(sessionTimeout_);
+        for (auto s : sessions_) {
+            if (!s->subscribed_ && s->last_activity_ < deadline) {
+                logging::warning("Session timed out!");
+                s->close();
+            }
+        }
+    }
 
-        typedef function<void()> on_exit_type;
-        on_exit_type on_exit_;
+    struct session_server {
+        enum { max_sessions = 16 };
 
-        unique_ptr<target_control> target_control_{};
+        tcp::acceptor acceptor_;
+        tcp::socket socket_;
+        const server_ready_marker server_ready_{};  // Used to light a LED when server is ready
+        program_executor& executor_;
+        session_registry registry_;
+        unique_ptr<session_active_marker> session_active_;
+        unique_ptr<button_handler> button_handler_;
 
-        const session_active_marker session_active_{};
+        session_server(asio::io_context& io_context, short port, program_executor& executor)
+            : acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+            , socket_(io_context)
+            , executor_(executor)
+            , registry_(io_context, [this](bool leased) { on_lease(leased); })
+        {
+            on_lease(false);
+            start_accept();
+        }
 
-        session(tcp::socket socket, on_exit_type on_exit)
-            : socket_(move(socket)), timer_(socket_.get_io_context()), on_exit_(on_exit)
+        // The button is only active while no client controls the target.
+        void on_lease(bool leased)
         {
-            cout << "Session started" << endl;
-            try {
-                target_control_.reset(new target_control());
-            } catch (exception& e) {
-                cerr << "Exception: " << e.what() << endl;
+            if (leased) {
+                button_handler_ = nullptr;
+                session_active_.reset(new session_active_marker());
+            } else {
+                if (disconnectPolicy_ == disconnect_policy::stop)
+                    executor_.stop_program();
+                session_active_ = nullptr;
+                if (executor_.target_control_)
+                    button_handler_.reset(
+                        new button_handler(*executor_.target_control_, executor_.io_context_, [this] {
+                            if (executor_.events_.active())
+                                executor_.events_.publish("BUTTON");
+                        }));
             }
         }
-        ~session()
+
+        void start_accept()
         {
-            stop_program();
-            cout << "Session stopped" << endl;
-            if (on_exit_)
-                on_exit_();
+            acceptor_.async_accept(socket_, [this](error_code ec) {
+                if (!ec) {
+                    if (registry_.size() < max_sessions) {
+                        make_shared<session>(move(socket_), executor_, registry_)->start();
+                    } else {
+                        asio::error_code ignored;
+                        asio::write(socket_, asio::buffer(string("ERROR=Busy\r\n")), ignored);
+                        socket_.close(ignored);
+                    }
+                }
+                start_accept();
+            });
+        }
+    };
+
+    // HTTP status of a command failure.
+    int http_status(protocol::status s)
+    {
+        switch (s) {
+        case protocol::status::ok:
+            return 200;
+        case protocol::status::syntax:
+            return 400;
+        case protocol::status::unknown_command:
+        case protocol::status::unknown_program:
+            return 404;
+        case protocol::status::clock:
+        case protocol::status::library:
+        case protocol::status::target:
+            return 503;
+        default:
+            return 409;
         }
+    }
 
-        void start() { do_read(); }
+    // JSON over HTTP/1.1 for web front ends, on the daemon's own io_context. Requests that
+    // change state act for the holder of the controller lease when they carry its token in
+    // X-Lease-Token, or for anyone while the lease is free, so a web front end never takes a
+    // session's place. An idle keep-alive connection is only a socket with a pending read.
+    struct http_connection : enable_shared_from_this<http_connection>, event_subscriber {
+        using clock_type = timing::clock;
+        enum { max_pending_events = 1024 * 1024 };  // A stream is closed past this much unsent
 
-        void set_timer()
+        tcp::socket socket_;
+        array<char, 4096> read_buffer_;
+        http::request_parser parser_;
+        clock_type::time_point last_activity_{clock_type::now()};
+        bool streaming_{};  // Sending events, the connection stays open however long it is idle
+        bool closing_{};    // Closed once queued responses are written
+
+        deque<string> write_queue_;
+        size_t writing_{};
+        size_t pending_bytes_{};
+        vector<asio::const_buffer> write_buffers_;
+
+        program_executor& executor_;
+        program_commands commands_;
+        session_registry& registry_;
+        set<http_connection*>& connections_;
+
+        http_connection(tcp::socket socket,
+                        program_executor& executor,
+                        session_registry& registry,
+                        set<http_connection*>& connections)
+            : socket_(move(socket))
+            , executor_(executor)
+            , commands_{executor}
+            , registry_(registry)
+            , connections_(connections)
         {
-            auto self = shared_from_this();
-            timer_.async_wait([this, self](error_code ec) {
-                if (ec != asio::error::operation_aborted) {
-                    asio::post(socket_.get_io_context(), [this]() { socket_.close(); });
-                    cerr << "Session timed out!" << endl;
-                } else if (!ec)
-                    self->set_timer();
-            });
+            connections_.insert(this);
         }
-
-        bool is_executing()
+        ~http_connection()
         {
-            if (programJob_.valid()) {
-                if (programJob_.wait_for(chrono::seconds(0)) == future_status::timeout)
-                    return true;
-                programJob_.get();
-            }
-            return false;
+            executor_.events_.unsubscribe(this);
+            connections_.erase(this);
         }
 
-        void stop_program()
+        void start()
         {
-            if (is_executing()) {
-                stop_flag_ = true;
-                cv_.notify_one();
-                programJob_ = future<void>{};
-            }
+            asio::error_code ignored;
+            socket_.set_option(tcp::no_delay(true), ignored);
+            do_read();
         }
 
-        void start_program()
+        void close()
         {
-            if (is_executing())
-                throw runtime_error("Executing");
-
-            if (program_.empty())
-                throw runtime_error("Empty");
+            asio::error_code ignored;
+            socket_.close(ignored);
+        }
 
-            cout << "Started program with " << program_.size() << " steps..." << endl;
-
-            stop_flag_ = false;
-
-            programJob_ = async(launch::async, [this] {
-                const running_program_marker running_program_marker_;
-                (void)running_program_marker_;
-                programStartTime_    = clock_type::now();
-                auto currentStepTime = programStartTime_;
-                for (const auto& current_step : program_) {
-                    currentStepTime += current_step.time_to_execute_;
-                    {
-                        unique_lock<mutex> lock(mutex_);
-                        if (cv_.wait_until(lock, currentStepTime, [&] { return stop_flag_; })) {
-                            cout << "Program stopped!" << endl;
-                            return;
-                        }
-                    }
-                    if (current_step.fn_) {
-                        auto t_relative =
-                            chrono::duration_cast<chrono::milliseconds>(currentStepTime - programStartTime_).count();
-                        cout << "T" << t_relative << ": ";
-                        try {
-                            current_step.fn_();
-                        } catch (exception& e) {
-                            cout << " Error: " << e.what();
-                        }
-                        cout << endl;
+        void do_read()
+        {
+            auto self = shared_from_this();
+            socket_.async_read_some(asio::buffer(read_buffer_), [this, self](error_code ec, size_t length) {
+                if (ec)
+                    return;
+                last_activity_ = clock_type::now();
+                // A stream only ends by the client closing it, anything else it sends is ignored
+                if (!streaming_) {
+                    int error = parser_.feed(read_buffer_.data(), length, [this](http::request& r) {
+                        if (!closing_ && !streaming_)
+                            handle(r);
+                    });
+                    if (error) {
+                        send(http::response(error, "{\"error\":\"Syntax\"}", false));
+                        closing_ = true;
                     }
                 }
-                cout << "Program ended!" << endl;
+                if (!closing_)
+                    do_read();
             });
         }
 
-        string parse_command(const string& s)
+        void handle(http::request& r)
         {
+            int status = 200;
+            string body;
             try {
-                switch (s.front()) {
-                case 'C':  // Clear program
-                    stop_program();
-                    program_.clear();
-                    cout << "Program cleared!" << endl;
-                    break;
-
-                case 'T': {
-                    auto ms = int(stof(s.substr(1)) * 1000);
-                    program_.emplace_back(chrono::milliseconds(ms), function<void()>{});
+                status = route(r, body);
+            } catch (const runtime_error& e) {
+                // Malformed JSON or a value of the wrong type
+                status = 400;
+                body   = string("{\"error\":") + json::quote(e.what()) + "}";
+            }
+            if (streaming_)
+                return;
+            if (body.empty())
+                body = "{}";
+            send(http::response(status, body, r.keep_alive_));
+            if (!r.keep_alive_)
+                closing_ = true;
+        }
 
-                } break;
+        // Answers a command's status, with `body` on success.
+        static int reply(protocol::status s, string& body, const string& success = "{}")
+        {
+            body = s == protocol::status::ok ? success : string("{\"error\":\"") + protocol::to_string(s) + "\"}";
+            return http_status(s);
+        }
 
-                case 'A':  // Play audio
-                {
-                    auto arg = s.substr(1);
-                    if (arg.empty())
-                        throw runtime_error("Syntax");
+        static int method_not_allowed(string& body)
+        {
+            body = "{\"error\":\"MethodNotAllowed\"}";
+            return 405;
+        }
 
-                    program_.emplace_back(chrono::milliseconds::zero(), [this, arg] {
-                        cout << "Playing audio file '" << arg << "';";
-                        if (!audioPlayCmdLinePrefix_.empty()) {
-                            string cmdline = audioPlayCmdLinePrefix_;
-                            size_t index   = cmdline.find("{f}");
-                            if (index != string::npos)
-                                cmdline.replace(index, arg.length(), arg);
-                            thread([cmdline] { system(cmdline.c_str()); }).detach();
-                        }
+        int route(http::request& r, string& body)
+        {
+            const bool get = r.method_ == "GET";
+            if (r.path_ == "/state") {
+                if (!get)
+                    return method_not_allowed(body);
+                body = state_json();
+                return 200;
+            }
+            if (r.path_ == "/events") {
+                if (!get)
+                    return method_not_allowed(body);
+                send(http::chunked_head(200, "text/event-stream"));
+                streaming_ = true;
+                executor_.events_.subscribe(this);
+                return 200;
+            }
 
-                    });
-                } break;
+            const bool post = r.method_ == "POST" || (r.path_ == "/program" && r.method_ == "PUT");
+            if (r.path_ != "/program" && r.path_ != "/arm" && r.path_ != "/run" && r.path_ != "/stop" &&
+                r.path_ != "/move" && r.path_ != "/play")
+                return reply(protocol::status::unknown_command, body);
+            if (!post)
+                return method_not_allowed(body);
+            if (!registry_.may_control(r.lease_token_))
+                return reply(protocol::status::busy, body);
+
+            const auto args = r.body_.empty() ? json::value{} : json::parse(r.body_);
+            if (r.path_ == "/program")
+                return upload(args, body);
+            if (r.path_ == "/run") {
+                auto at = args.find("at");  // Seconds of the shared timebase
+                if (at && (!at->is_number() || at->number_ < 0 || at->number_ * 1e6 > double(int64_t(1) << 62)))
+                    return reply(protocol::status::syntax, body);
+                return reply(at ? commands_.run_at(int64_t(at->number_ * 1e6)) : commands_.run(last_activity_), body);
+            }
+            if (r.path_ == "/stop")
+                return reply(commands_.stop(), body);
+            if (r.path_ == "/arm")
+                return arm(body);
+            if (r.path_ == "/move") {
+                auto position = args.find("position");
+                auto lanes    = args.find("lanes");
+                if (!position || !position->is_number() || (lanes && !is_mask(*lanes)))
+                    return reply(protocol::status::syntax, body);
+                auto mask = lanes ? uint32_t(lanes->number_) : program_commands::all_lanes();
+                return reply(commands_.move(position->number_ != 0, mask), body);
+            }
+            auto path = args.find("path");
+            if (!path || !path->is_string())
+                return reply(protocol::status::syntax, body);
+            return reply(commands_.play(path->string_), body);
+        }
 
-                case 'M':  // Move target
-                {
-                    auto arg = stoi(s.substr(1));
-                    program_.emplace_back(chrono::seconds::zero(), [this, arg] {
-                        cout << "Moving target to position '" << arg << "';";
-                        if (target_control_)
-                            target_control_->move_target(!!arg);
-                    });
-                } break;
+        // A lane mask fits uint32_t, whether the lanes exist is checked by its user.
+        static bool is_mask(const json::value& v) { return v.is_number() && v.number_ >= 0 && v.number_ <= UINT32_MAX; }
 
-                case 'P':  // Play audio file directly
-                {
-                    if (is_executing())
-                        throw runtime_error("Executing");
+        // Adds steps to `p`, false if one is invalid. A step may instead be a repeated block of
+        // steps, and a delay the name of a parameter.
+        static bool add_steps(const json::value& steps, program::compiled_program& p)
+        {
+            if (steps.type_ != json::value::type::array)
+                return false;
+            for (const auto& step : steps.array_) {
+                auto repeat = step.find("repeat");
+                if (repeat) {
+                    auto block = step.find("steps");
+                    if (!repeat->is_number() || repeat->number_ < 1 || repeat->number_ > UINT32_MAX || !block)
+                        return false;
+                    p.begin_repeat(uint32_t(repeat->number_));
+                    if (!add_steps(*block, p))
+                        return false;
+                    p.end_repeat();
+                    continue;
+                }
+                auto delay    = step.find("delay");
+                auto position = step.find("move");
+                auto lanes    = step.find("lanes");
+                auto audio    = step.find("audio");
+                if ((delay && !delay->is_string() && (!delay->is_number() || delay->number_ < 0)) ||
+                    (position && !position->is_number()) || (lanes && !is_mask(*lanes)) ||
+                    (audio && (!audio->is_string() || audio->string_.empty())))
+                    return false;
+                if (delay && delay->is_string())
+                    p.advance(delay->string_);
+                else if (delay) {
+                    auto ms = delay->number_ * 1000;
+                    if (ms > double(UINT32_MAX - p.total_time()))
+                        return false;
+                    p.advance(uint32_t(ms));
+                }
+                if (position) {
+                    auto mask = lanes ? uint32_t(lanes->number_) : program_commands::all_lanes();
+                    if (mask == 0 || (mask & ~program_commands::all_lanes()))
+                        return false;
+                    p.add_move(position->number_ != 0, uint16_t(mask));
+                }
+                if (audio)
+                    p.add_audio(audio->string_);
+            }
+            return true;
+        }
 
-                    auto arg = s.substr(1);
-                    if (arg.empty())
-                        throw runtime_error("Syntax");
+        // {"parameters":{"<name>":<s>,...},"steps":[{"delay":<s>|"<name>","move":<0|1>,
+        // "lanes":<mask>,"audio":"<path>"} or {"repeat":<n>,"steps":[...]},...]} with every member
+        // of a step optional, as "$<name>=<s>" and "T<delay>;M<move>,<lanes>;A<audio>" or
+        // "[<n>;...;]" in the text protocol. The program is replaced at once, and only if it is
+        // valid as a whole.
+        int upload(const json::value& args, string& body)
+        {
+            auto parameters = args.find("parameters");
+            auto steps      = args.find("steps");
+            if (!steps || (parameters && parameters->type_ != json::value::type::object))
+                return reply(protocol::status::syntax, body);
 
-                    cout << "Playing audio file '" << arg << "' directly\n";
-                    if (!audioPlayCmdLinePrefix_.empty()) {
-                        string cmdline = audioPlayCmdLinePrefix_;
-                        size_t index   = cmdline.find("{f}");
-                        if (index != string::npos)
-                            cmdline.replace(index, arg.length(), arg);
-                        thread([cmdline] { system(cmdline.c_str()); }).detach();
+            program::compiled_program p;
+            try {
+                if (parameters) {
+                    for (const auto& param : parameters->object_) {
+                        if (!param.second.is_number() || param.second.number_ < 0 ||
+                            param.second.number_ * 1000 > UINT32_MAX)
+                            return reply(protocol::status::syntax, body);
+                        p.set_parameter(param.first, uint32_t(param.second.number_ * 1000));
                     }
-
-                } break;
-
-                case 'D':  // Move target directly
-                    if (is_executing())
-                        throw runtime_error("Executing");
-
-                    if (target_control_) {
-                        auto arg = stoi(s.substr(1));
-                        cout << "Moving target to position '" << arg << "'" << endl;
-                        target_control_->move_target(!!arg);
-                    } else
-                        throw runtime_error("Target");
-                    break;
-
-                case 'R':  // Run program
-                    start_program();
-                    break;
-
-                case 'S':  // Stop program
-                    stop_program();
-                    break;
-
-                case 'Q':  // Query state
-                {
-                    stringstream msg;
-                    auto t_relative =
-                        chrono::duration_cast<chrono::milliseconds>(clock_type::now() - programStartTime_).count();
-                    auto t_total = chrono::milliseconds::zero();
-                    for (auto& step : program_)
-                        t_total += step.time_to_execute_;
-
-                    msg << "EXEC=" << (is_executing() ? to_string(t_relative / 1000.0) : "") << "\r\n"
-                        << "PROG=" << (!program_.empty() ? to_string(t_total.count() / 1000.0) : "") << "\r\n"
-                        << "POS=" << (target_control_ ? to_string(int(target_control_->position())) : "") << "\r\n";
-                    return msg.str();
-                } break;
-
-                case 'X':  // Exit, will disconnect the session immediately
-                    throw client_exit();
-
-                default:
-                    throw runtime_error("UnknownCommand");
                 }
+                if (!add_steps(*steps, p))
+                    return reply(protocol::status::syntax, body);
+            } catch (runtime_error&) {
+                return reply(protocol::status::syntax, body);
+            }
+            if (p.empty())
+                return reply(protocol::status::empty, body);
+
+            stringstream msg;
+            msg << "{\"program\":" << p.total_time() / 1000.0 << ",\"steps\":" << p.step_count() << ",\"hash\":\""
+                << library::to_hex(p.hash()) << "\"}";
+            auto success = msg.str();
+            return reply(commands_.load(move(p)), body, success);
+        }
 
-                return move(string{});
-            } catch (runtime_error& e) {
-                throw e;
-            } catch (const exception&) {
-                throw runtime_error("Syntax");
+        // {"steps":<n>,"warnings":[{"type":"Spacing","step":<i>,"lanes":<mask>,"gap":<s>} or
+        // {"type":"Audio","step":<i>,"path":"<path>"},...]}
+        int arm(string& body)
+        {
+            vector<arm_warning> warnings;
+            auto st = commands_.arm(warnings);
+            stringstream msg;
+            msg << "{\"steps\":" << executor_.program_.step_count() << ",\"warnings\":[";
+            for (size_t i = 0; i < warnings.size(); ++i) {
+                const auto& w = warnings[i];
+                const bool spacing = w.kind_ == arm_warning::kind::spacing;
+                msg << (i ? "," : "") << "{\"type\":\"" << (spacing ? "Spacing" : "Audio") << "\",\"step\":" << w.step_;
+                if (spacing)
+                    msg << ",\"lanes\":" << w.lanes_ << ",\"gap\":" << w.gap_ms_ / 1000.0 << "}";
+                else
+                    msg << ",\"path\":" << json::quote(w.path_) << "}";
             }
+            msg << "]}";
+            return reply(st, body, msg.str());
         }
 
-        void do_read()
+        string state_json() const
+        {
+            const auto state = executor_.state_.load();
+            stringstream msg;
+            msg << "{\"running\":" << (state.running_ ? "true" : "false") << ",\"exec\":";
+            if (state.running_) {
+                auto start = program_executor::clock_type::time_point(chrono::nanoseconds(state.start_time_));
+                auto t     = chrono::duration_cast<chrono::milliseconds>(program_executor::clock_type::now() - start);
+                if (t.count() >= 0)
+                    msg << t.count() / 1000.0;
+                else
+                    msg << "null";
+            } else
+                msg << "null";
+            msg << ",\"program\":";
+            if (state.has_program_)
+                msg << state.total_time_ / 1000.0;
+            else
+                msg << "null";
+            msg << ",\"step\":" << state.step_ << ",\"positions\":[";
+            for (size_t i = 0; i < state.lane_count_; ++i)
+                msg << (i ? "," : "") << ((state.positions_ >> i) & 1);
+            msg << "],\"leased\":" << (registry_.token().empty() ? "false" : "true") << "}";
+            return msg.str();
+        }
+
+        // A stream that isn't read is closed rather than have its events pile up, as for
+        // subscribed sessions.
+        void send_event(event_message& e) override
         {
-            if (sessionTimeout_ > 0) {
-                // Start watchdog timer
-                timer_.cancel();
-                timer_.expires_after(chrono::seconds(sessionTimeout_));
-                set_timer();
+            if (!streaming_ || !socket_.is_open())
+                return;
+            if (pending_bytes_ > max_pending_events) {
+                logging::warning("Event stream isn't read, connection closed");
+                close();
+                return;
             }
+            send(e.stream());
+        }
 
-            auto self = shared_from_this();
-            socket_.async_read_some(asio::buffer(data_, max_length), [this, self](error_code ec, size_t length) {
-                if (!ec) {
-                    try {
-                        auto cmds = split_commands(move(string{data_.data(), length}));
-                        if (!cmds.empty()) {
-                            string reply;
-                            for (auto& cmd : cmds)
-                                reply += parse_command(cmd);
-
-                            if (!reply.empty())
-                                do_write(reply);
-                            else
-                                do_write("OK\r\n");
-                        } else
-                            do_read();
-                    } catch (const client_exit&) {
-                        timer_.cancel();
-                    } catch (const exception& e) {
-                        stringstream msg;
-                        msg << "ERROR=" << e.what() << "\r\n";
-                        do_write(msg.str());
-                    }
-                } else
-                    timer_.cancel();
-            });
+        void send(string msg)
+        {
+            pending_bytes_ += msg.size();
+            write_queue_.push_back(move(msg));
+            if (writing_ == 0)
+                do_write();
         }
 
-        void do_write(const string& msg)
+        void do_write()
         {
-            size_t len = msg.copy(data_.data(), max_length);
-            auto self  = shared_from_this();
-            asio::async_write(socket_, asio::buffer(data_, len), [this, self](error_code ec, size_t /*length*/) {
-                if (!ec)
-                    do_read();
-                else
-                    timer_.cancel();
+            write_buffers_.clear();
+            for (const auto& msg : write_queue_)
+                write_buffers_.push_back(asio::buffer(msg));
+            writing_ = write_queue_.size();
+
+            auto self = shared_from_this();
+            asio::async_write(socket_, write_buffers_, [this, self](error_code ec, size_t length) {
+                if (ec) {
+                    close();
+                    return;
+                }
+                write_queue_.erase(write_queue_.begin(), write_queue_.begin() + writing_);
+                pending_bytes_ -= length;
+                writing_ = 0;
+                if (!write_queue_.empty())
+                    do_write();
+                else if (closing_) {
+                    asio::error_code ignored;
+                    socket_.shutdown(tcp::socket::shutdown_both, ignored);
+                    close();
+                }
             });
         }
     };
 
-    struct single_connection_server {
-        tcp::acceptor acceptor_;
-        const short port_;
-        const server_ready_marker server_ready_;  // Used to light a LED when server is ready
-        unique_ptr<button_handler> button_handler_;
+    struct http_server {
+        enum { max_connections = 64, idle_timeout_s = 60 };
 
-        single_connection_server(asio::io_context& io_context, short port) : acceptor_(io_context), port_(port)
+        tcp::acceptor acceptor_;
+        tcp::socket socket_;
+        asio::steady_timer sweep_;
+        program_executor& executor_;
+        session_registry& registry_;
+        set<http_connection*> connections_;
+
+        http_server(asio::io_context& io_context, short port, program_executor& executor, session_registry& registry)
+            : acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+            , socket_(io_context)
+            , sweep_(io_context)
+            , executor_(executor)
+            , registry_(registry)
         {
             start_accept();
         }
 
         void start_accept()
         {
-            if (!button_handler_)
-                button_handler_ = make_unique<button_handler>();
-
-            tcp::endpoint endpoint(tcp::v4(), port_);
-            acceptor_.open(endpoint.protocol());
-            acceptor_.bind(endpoint);
-            acceptor_.listen(1);  // accept 1 connection at a time
-            acceptor_.async_accept([this](error_code ec, tcp::socket socket) {
+            acceptor_.async_accept(socket_, [this](error_code ec) {
                 if (!ec) {
-                    stop_accept();
-                    make_shared<session>(move(socket), [&] { start_accept(); })->start();
-                } else
-                    start_accept();
-
+                    if (connections_.size() < max_connections) {
+                        make_shared<http_connection>(move(socket_), executor_, registry_, connections_)->start();
+                        if (connections_.size() == 1)
+                            arm_sweep();
+                    } else {
+                        asio::error_code ignored;
+                        socket_.close(ignored);
+                    }
+                }
+                start_accept();
             });
         }
 
-        void stop_accept()
+        // One timer for all connections, and only while there are any.
+        void arm_sweep()
         {
-            button_handler_ = nullptr;
-            acceptor_.close();
+            sweep_.expires_after(chrono::seconds(10));
+            sweep_.async_wait([this](error_code ec) {
+                if (ec)
+                    return;
+                auto deadline = http_connection::clock_type::now() - chrono::seconds(idle_timeout_s);
+                for (auto c : connections_) {
+                    if (!c->streaming_ && c->last_activity_ < deadline)
+                        c->close();
+                }
+                if (!connections_.empty())
+                    arm_sweep();
+            });
         }
     };
 
-    struct broadcast_server {
+    // Owned by a shared_ptr, which the pending receive holds too, so the server outlives
+    // its socket until the aborted receive has completed.
+    struct broadcast_server : enable_shared_from_this<broadcast_server> {
+        using clock_type = chrono::steady_clock;
+
         udp::endpoint sender_endpoint_;
         udp::socket socket_;
         asio::ip::address_v4 address_;
@@ -549,35 +2605,112 @@ namespace
         enum { max_length = 4096 };
         char data_[max_length];
 
-        broadcast_server(asio::io_context& io_context, const string& token, asio::ip::address_v4 addr, int port)
-            : socket_(io_context), token_(token), address_(addr), port_(port)
+        // Replies are the same for every sender, so they are built once. A sender gets at
+        // most one reply per holdoff and the total number of replies per second is capped,
+        // so a storm of broadcasts costs little more than receiving them.
+        enum { max_replies_per_second = 20, max_senders = 64 };
+        const string reply_;
+        const chrono::milliseconds sender_holdoff_{500};
+        map<udp::endpoint, clock_type::time_point> last_reply_;
+        clock_type::time_point window_start_{};
+        unsigned window_replies_{};
+        unsigned suppressed_{};
+
+        // Time requests have a budget of their own, so a storm of discovery broadcasts can't
+        // starve clock sync, and no holdoff, so a client may take several samples a second.
+        enum { max_time_replies_per_second = 200 };
+        clock_type::time_point time_window_start_{};
+        unsigned time_replies_{};
+        const bool discovery_;  // Answers the token, otherwise only time requests
+
+        broadcast_server(
+            asio::io_context& io_context, const string& token, asio::ip::address_v4 addr, int port, bool discovery = true)
+            : socket_(io_context)
+            , token_(token)
+            , address_(addr)
+            , port_(port)
+            , reply_("IP:" + addr.to_string() + ":" + to_string(port) + "\r\n")
+            , discovery_(discovery)
         {
             udp::endpoint listen_ep(addr, port_);
             socket_.open(listen_ep.protocol());
             socket_.set_option(udp::socket::reuse_address(true));
             socket_.set_option(udp::socket::broadcast(true));
             socket_.bind(listen_ep);
-            start_async_receive();
+        }
+
+        void start() { start_async_receive(); }
+
+        // Closes the socket, the pending receive completes with operation_aborted.
+        void stop()
+        {
+            asio::error_code ignored;
+            socket_.close(ignored);
+        }
+
+        bool may_reply(const udp::endpoint& sender)
+        {
+            const auto now = clock_type::now();
+            if (now - window_start_ >= chrono::seconds(1)) {
+                if (suppressed_)
+                    logging::info("Suppressed {} discovery replies", suppressed_);
+                window_start_   = now;
+                window_replies_ = 0;
+                suppressed_     = 0;
+                // Forget senders outside the holdoff, keeps the map small
+                for (auto it = last_reply_.begin(); it != last_reply_.end();)
+                    it = (now - it->second >= sender_holdoff_) ? last_reply_.erase(it) : next(it);
+            }
+            auto it = last_reply_.find(sender);
+            if (window_replies_ >= max_replies_per_second ||
+                (it != last_reply_.end() && now - it->second < sender_holdoff_) ||
+                (it == last_reply_.end() && last_reply_.size() >= max_senders)) {
+                ++suppressed_;
+                return false;
+            }
+            ++window_replies_;
+            last_reply_[sender] = now;
+            return true;
+        }
+
+        bool may_answer_time()
+        {
+            const auto now = clock_type::now();
+            if (now - time_window_start_ >= chrono::seconds(1)) {
+                time_window_start_ = now;
+                time_replies_      = 0;
+            }
+            return time_replies_++ < max_time_replies_per_second;
         }
 
         void start_async_receive()
         {
-            socket_.async_receive_from(
-                asio::buffer(data_, max_length),
-                sender_endpoint_,
-                bind(&broadcast_server::handle_receive_from, this, placeholders::_1, placeholders::_2));
+            auto self = shared_from_this();
+            socket_.async_receive_from(asio::buffer(data_, max_length),
+                                       sender_endpoint_,
+                                       [this, self](const asio::error_code& ec, size_t length) {
+                                           handle_receive_from(ec, length);
+                                       });
         }
 
         void handle_receive_from(const asio::error_code& error, size_t bytes_recvd)
         {
+            if (error == asio::error::operation_aborted)
+                return;
             if (!error) {
-                auto s = string{data_, data_ + bytes_recvd};
-                if (s.find(token_) != string::npos) {
-                    // Token is found!
-                    stringstream ss;
-                    ss << "IP:" << address_.to_string() << ":" << port_ << "\r\n";
-                    socket_.send_to(asio::buffer(ss.str()), sender_endpoint_);
-                    cout << "Token intercepted, sent address to " << sender_endpoint_.address().to_string() << endl;
+                auto end  = data_ + bytes_recvd;
+                auto time = timesync::answer(data_, bytes_recvd, timesync::now_us());
+                if (!time.empty()) {
+                    if (may_answer_time()) {
+                        asio::error_code ignored;
+                        socket_.send_to(asio::buffer(time), sender_endpoint_, 0, ignored);
+                    }
+                } else if (discovery_ && search(data_, end, token_.begin(), token_.end()) != end &&
+                           may_reply(sender_endpoint_)) {
+                    // Token is found! The reply is never modified, so it can be sent without a copy
+                    asio::error_code ignored;
+                    socket_.send_to(asio::buffer(reply_), sender_endpoint_, 0, ignored);
+                    logging::info("Token intercepted, sent address to {}", sender_endpoint_.address().to_string());
                 }
             }
             start_async_receive();
@@ -591,43 +2724,222 @@ int main(int argc, char* argv[])
 
     try {
         string token("{BC5C0A2F-7091-4254-B576-7F0E2F0441A6}");
-        int port = 7777;
+        string audioSink;
+        string libraryDir;
+        string onDisconnect = "stop";
+        string timeRef;
+        string logLevel = "info";
+        string lanePins = to_string(int(GPIO::TURN_FRONT)) + ":" + to_string(int(GPIO::TURN_AWAY));
+        int port        = 7777;
+        int httpPort    = 0;
+        realtime::settings realtimeSettings;
+        bool realtimeMode  = false;
+        int spinUs         = 300;
+        double audioLeadMs = 0;
+        double moveLeadMs  = 0;
+        size_t jitterSteps = 0;
+        string simulateKey;
 
         app.add_option("--port", port, "Port to listen upon, default is 7777");
-        app.add_option("--play-cmd", audioPlayCmdLinePrefix_, "Audio play cmd line prefix")->required(true);
+        app.add_option("--http-port", httpPort, "Port of the HTTP/JSON endpoint, disabled if not given");
+        app.add_option("--play-cmd",
+                       audioPlayCmdLinePrefix_,
+                       "Audio play cmd line prefix, used when no audio sink is given or a file can't be decoded");
+        app.add_option("--audio-sink",
+                       audioSink,
+                       "Play WAV files in-process on sink 'alsa[:<device>]', 'null' or 'file:<path>'");
         app.add_option(
             "--timeout",
             sessionTimeout_,
             "Watchdog timeout in seconds (default " + to_string(sessionTimeout_) + "), zero disables watchdog",
             true);
         app.add_option("--token", token, "Token to listen for on broadcast address, default is '" + token + "'");
+        app.add_option("--on-disconnect",
+                       onDisconnect,
+                       "Whether a program is stopped ('stop') or keeps running ('continue') when the controlling "
+                       "client is lost, default is 'stop'");
+        app.add_option("--resume-grace",
+                       resumeGrace_,
+                       "Seconds the lease is kept for its resume token after a disconnect (with --on-disconnect "
+                       "continue), default is " + to_string(resumeGrace_),
+                       true);
+        app.add_option("--time-ref",
+                       timeRef,
+                       "Daemon at <host>[:<port>] whose clock is the shared timebase for R<time>, default is this one");
+        app.add_option(
+            "--log-level", logLevel, "Least severe messages logged: 'error', 'warning', 'info' or 'debug'", true);
+        app.add_option("--library", libraryDir, "Directory of the program library, disabled if not given");
+        app.add_option("--audio-lead",
+                       audioLeadMs,
+                       "Milliseconds audio steps are started ahead of their time, until the sound is heard; "
+                       "the K command measures it for the audio sink");
+        app.add_option("--move-lead",
+                       moveLeadMs,
+                       "Milliseconds move steps are started ahead of their time, until the target has turned");
+        app.add_option("--lanes",
+                       lanePins,
+                       "Target pins per lane as <front>:<away>[,<front>:<away>...], default is '" + lanePins + "'");
+
+        app.add_flag("--realtime",
+                     realtimeMode,
+                     "Run steps on a thread of their own with SCHED_FIFO priority and locked memory, waking early "
+                     "and spinning to each step");
+        app.add_option("--rt-priority", realtimeSettings.priority_, "SCHED_FIFO priority in real-time mode", true);
+        app.add_option("--rt-cpu", realtimeSettings.cpu_, "CPU to pin to in real-time mode, default is any");
+        app.add_option("--rt-spin", spinUs, "Microseconds busy waited before each step in real-time mode", true);
+        app.add_option("--jitter-test", jitterSteps, "Run this many steps 1 ms apart, report their lateness and exit");
+        app.add_option("--simulate",
+                       simulateKey,
+                       "Run the library program <name>, #<hash> or '*' for all in virtual time, print what it does "
+                       "and exit");
 
         CLI11_PARSE(app, argc, argv);
 
-        cout << "Audio play prefix: '" << audioPlayCmdLinePrefix_ << "'" << endl;
+        logging::level level;
+        if (!logging::parse_level(logLevel, level))
+            throw runtime_error("--log-level must be 'error', 'warning', 'info' or 'debug'");
+        logging::set_level(level);
 
-        asio::io_context io_context;
-        single_connection_server s(io_context, port);
-        cout << "Daemon started listening on port " << port << endl;
+        lanes_ = gpio::parse_lanes(lanePins);
+
+        if (audioLeadMs < 0 || moveLeadMs < 0)
+            throw runtime_error("--audio-lead and --move-lead must not be negative");
+        audioLead_ = chrono::microseconds(int64_t(audioLeadMs * 1000));
+        moveLead_  = chrono::microseconds(int64_t(moveLeadMs * 1000));
+
+        if (onDisconnect == "continue")
+            disconnectPolicy_ = disconnect_policy::keep_running;
+        else if (onDisconnect != "stop")
+            throw runtime_error("--on-disconnect must be 'stop' or 'continue'");
+
+        if (audioSink.empty() && audioPlayCmdLinePrefix_.empty() && simulateKey.empty())
+            throw runtime_error("Either --audio-sink or --play-cmd must be given");
+
+        if (!audioSink.empty()) {
+            audioEngine_.reset(new audio::engine(audio::make_sink(audioSink), &audioLatency_));
+            logging::info("Audio sink: '{}'", audioSink);
+        }
+        logging::info("Audio play prefix: '{}'", audioPlayCmdLinePrefix_);
+
+        if (!libraryDir.empty()) {
+            library_.reset(new library::store(libraryDir));
+            logging::info("Program library: '{}'", libraryDir);
+        }
+
+        if (!simulateKey.empty()) {
+            // Spinning waits for real time to pass, which never comes in virtual time
+            if (!library_ || realtimeMode)
+                throw runtime_error("--simulate needs --library and can't be used with --realtime");
+            timing::simulate();
+            auto result = simulate_library(simulateKey);
+            logging::flush();
+            return result;
+        }
+
+        if (realtimeMode)
+            stepSpin_ = chrono::microseconds(spinUs);
+        auto enter_realtime = [&](dispatch_thread& dispatch) {
+            dispatch.start(realtimeSettings);
+            logging::info("Real-time mode: priority {}, CPU {}, spin {} us",
+                          realtimeSettings.priority_,
+                          realtimeSettings.cpu_,
+                          spinUs);
+        };
+        if (jitterSteps > 0) {
+            // Steps run where they would in the daemon, on the dispatch thread in real-time mode
+            metrics::histogram::summary result;
+            if (realtimeMode) {
+                dispatch_thread dispatch;
+                enter_realtime(dispatch);
+                run_on(dispatch.io_context_, [&] { result = jitter_test(jitterSteps); });
+            } else
+                result = jitter_test(jitterSteps);
+            cout << "JITTER=" << metrics::to_string(result) << endl;
+            logging::info("Jitter test: {} steps, p50 {} us, p99 {} us, max {} us",
+                          result.count,
+                          result.p50,
+                          result.p99,
+                          result.max);
+            logging::flush();
+            return 0;
+        }
 
-        // Start up broadcast receiver
-        vector<unique_ptr<broadcast_server>> bc_servers;
-        auto ip_addresses = utility::get_interface_addresses();
-        for (const auto& ip : ip_addresses) {
-            if (!ip.is_v4())
-                continue;
+        asio::io_context io_context;
+        unique_ptr<dispatch_thread> dispatch;
+        if (realtimeMode)
+            dispatch.reset(new dispatch_thread());
+        // The executor outlives sessions, so a program can survive a dropped connection
+        program_executor executor(io_context, dispatch ? dispatch->io_context_ : io_context);
+        if (dispatch)
+            enter_realtime(*dispatch);
+        session_server s(io_context, port, executor);
+        unique_ptr<timesync::clock_sync> clockSync;
+
+        if (!timeRef.empty()) {
+            // The reference answers on its discovery sockets, which use the same port as sessions
+            auto colon   = timeRef.rfind(':');
+            auto host    = timeRef.substr(0, colon);
+            auto service = (colon != string::npos) ? timeRef.substr(colon + 1) : to_string(port);
+            udp::resolver resolver(io_context);
+            auto reference = *resolver.resolve(udp::v4(), host, service).begin();
+            clockSync.reset(new timesync::clock_sync(io_context, reference));
+            clockSync_ = clockSync.get();
+            clockSync->start();
+            logging::info("Clock reference: {}:{}",
+                          reference.endpoint().address().to_string(),
+                          reference.endpoint().port());
+        }
+        logging::info("Daemon started listening on port {}", port);
 
-            if (ip.to_v4().is_loopback())
-                continue;
+        unique_ptr<http_server> web;
+        if (httpPort != 0) {
+            web.reset(new http_server(io_context, short(httpPort), executor, s.registry_));
+            logging::info("HTTP endpoint listening on port {}", httpPort);
+        }
 
-            auto p = make_unique<broadcast_server>(io_context, token, ip.to_v4(), port);
-            bc_servers.push_back(move(p));
-            cout << "Broadcast server listening on token '" << token << "' on IP " << ip.to_v4().to_string() << endl;
+        // Time requests are also answered on loopback, for daemons on the same host
+        shared_ptr<broadcast_server> time_server;
+        try {
+            time_server = make_shared<broadcast_server>(io_context, token, asio::ip::address_v4::loopback(), port, false);
+            time_server->start();
+        } catch (const exception& e) {
+            logging::error("Can't answer time requests on loopback: {}", e.what());
         }
 
+        // Start up broadcast receivers, one per IPv4 address as addresses come and go
+        map<asio::ip::address_v4, shared_ptr<broadcast_server>> bc_servers;
+        auto remove_server = [&](const asio::ip::address_v4& ip) {
+            auto it = bc_servers.find(ip);
+            if (it == bc_servers.end())
+                return false;
+            it->second->stop();
+            bc_servers.erase(it);
+            return true;
+        };
+        netmon::address_monitor monitor(io_context, [&](const asio::ip::address_v4& ip, bool added) {
+            if (ip.is_loopback())
+                return;
+            if (!added) {
+                if (remove_server(ip))
+                    logging::info("Broadcast server on IP {} removed", ip.to_string());
+                return;
+            }
+            try {
+                remove_server(ip);
+                auto server = make_shared<broadcast_server>(io_context, token, ip, port);
+                server->start();
+                bc_servers[ip] = server;
+                logging::info("Broadcast server listening on token '{}' on IP {}", token, ip.to_string());
+            } catch (const exception& e) {
+                // The address may already be gone again
+                logging::error("Can't listen on IP {}: {}", ip.to_string(), e.what());
+            }
+        });
+        monitor.start();
+
         io_context.run();
     } catch (exception& e) {
-        cerr << "Exception: " << e.what() << "\n";
+        logging::error("Exception: {}", e.what());
         return 1;
     }
     return 0;
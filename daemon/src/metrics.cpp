@@ -0,0 +1,64 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+namespace metrics
+{
+    size_t histogram::index_of(uint64_t us)
+    {
+        if (us < sub_buckets)
+            return size_t(us);
+        unsigned msb = 63;
+        while (!(us >> msb))
+            --msb;
+        // The three bits below the most significant one select the sub-bucket
+        size_t index = sub_buckets * (msb - 2) + size_t((us >> (msb - 3)) - sub_buckets);
+        return index < bucket_count ? index : bucket_count - 1;
+    }
+
+    uint64_t histogram::upper_bound(size_t index)
+    {
+        if (index < sub_buckets)
+            return index;
+        const unsigned msb = unsigned(index / sub_buckets) + 2;
+        const uint64_t sub = index % sub_buckets;
+        return ((sub_buckets + sub + 1) << (msb - 3)) - 1;
+    }
+
+    histogram::summary histogram::take()
+    {
+        summary s;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            s.buckets[i] = buckets_[i].exchange(0, memory_order_relaxed);
+            s.count += s.buckets[i];
+        }
+        s.max = max_.exchange(0, memory_order_relaxed);
+        s.p50 = s.percentile(0.50);
+        s.p99 = s.percentile(0.99);
+        return s;
+    }
+
+    uint64_t histogram::summary::percentile(double p) const
+    {
+        if (count == 0)
+            return 0;
+        const auto rank = uint64_t(p * count + 0.5);
+        uint64_t seen   = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += buckets[i];
+            if (seen >= rank && buckets[i] != 0)
+                return min(histogram::upper_bound(i), max);
+        }
+        return max;
+    }
+
+    string to_string(const histogram::summary& s)
+    {
+        stringstream ss;
+        ss << s.count << "," << s.p50 << "," << s.p99 << "," << s.max;
+        return ss.str();
+    }
+}
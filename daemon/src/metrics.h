@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace metrics
+{
+    // Fixed bucket latency histogram in microseconds. Buckets are logarithmic with 8 linear
+    // sub-buckets per power of two, so percentiles are within 12.5%. Recording is lock free
+    // and may be done from any thread.
+    struct histogram {
+        enum { sub_buckets = 8, bucket_count = 240 };
+
+        struct summary {
+            uint64_t count{};
+            uint64_t p50{};
+            uint64_t p99{};
+            uint64_t max{};
+            uint64_t percentile(double p) const;
+            std::array<uint64_t, bucket_count> buckets{};
+        };
+
+        void record(uint64_t us)
+        {
+            buckets_[index_of(us)].fetch_add(1, std::memory_order_relaxed);
+            auto m = max_.load(std::memory_order_relaxed);
+            while (us > m && !max_.compare_exchange_weak(m, us, std::memory_order_relaxed)) {
+            }
+        }
+
+        template <typename Rep, typename Period>
+        void record(std::chrono::duration<Rep, Period> d)
+        {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+            record(uint64_t(us > 0 ? us : 0));
+        }
+
+        // Returns the recorded distribution and starts over.
+        summary take();
+
+        static size_t index_of(uint64_t us);
+        // Largest value counted in bucket `index`.
+        static uint64_t upper_bound(size_t index);
+
+    private:
+        std::array<std::atomic<uint64_t>, bucket_count> buckets_{};
+        std::atomic<uint64_t> max_{};
+    };
+
+    // "<count>,<p50>,<p99>,<max>" in microseconds.
+    std::string to_string(const histogram::summary& s);
+}
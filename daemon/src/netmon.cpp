@@ -0,0 +1,161 @@
+#include "netmon.h"
+
+#include "log.h"
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#else
+#include "utility.h"
+#endif
+
+using namespace std;
+
+namespace netmon
+{
+    void address_monitor::update(const asio::ip::address_v4& address, bool added)
+    {
+        if (added ? addresses_.insert(address).second : addresses_.erase(address) != 0)
+            on_change_(address, added);
+    }
+
+#ifdef __linux__
+    address_monitor::address_monitor(asio::io_context& io_context, on_change_type on_change)
+        : on_change_(on_change), socket_(io_context)
+    {
+        int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+        if (fd < 0)
+            throw runtime_error("Can't open rtnetlink socket");
+        sockaddr_nl local{};
+        local.nl_family = AF_NETLINK;
+        local.nl_groups = RTMGRP_IPV4_IFADDR;
+        if (bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof local) != 0) {
+            close(fd);
+            throw runtime_error("Can't bind rtnetlink socket");
+        }
+        socket_.assign(asio::generic::raw_protocol(AF_NETLINK, NETLINK_ROUTE), fd);
+    }
+
+    void address_monitor::start()
+    {
+        request_dump();
+        do_receive();
+    }
+
+    // Asks for all current addresses, the replies are handled like notifications.
+    void address_monitor::request_dump()
+    {
+        struct {
+            nlmsghdr header_;
+            ifaddrmsg message_;
+        } request{};
+        request.header_.nlmsg_len   = sizeof request;
+        request.header_.nlmsg_type  = RTM_GETADDR;
+        request.header_.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        request.header_.nlmsg_seq   = ++dump_sequence_;
+        request.message_.ifa_family = AF_INET;
+
+        sockaddr_nl kernel{};
+        kernel.nl_family = AF_NETLINK;
+        dumping_         = true;
+        dumped_.clear();
+        auto to = reinterpret_cast<sockaddr*>(&kernel);
+        if (sendto(socket_.native_handle(), &request, sizeof request, 0, to, sizeof kernel) < 0)
+            logging::error("Can't request interface addresses");
+    }
+
+    void address_monitor::do_receive()
+    {
+        socket_.async_receive(asio::buffer(buffer_), [this](error_code ec, size_t length) {
+            if (ec == asio::error::operation_aborted)
+                return;
+            if (ec) {
+                // Notifications were lost (ENOBUFS), start over from a full dump
+                request_dump();
+            } else
+                handle_messages(length);
+            do_receive();
+        });
+    }
+
+    void address_monitor::handle_messages(size_t length)
+    {
+        int remaining = int(length);
+        for (auto h = reinterpret_cast<const nlmsghdr*>(buffer_.data()); NLMSG_OK(h, remaining);
+             h = NLMSG_NEXT(h, remaining)) {
+            const bool dump_reply = dumping_ && h->nlmsg_seq == dump_sequence_;
+            if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR) {
+                if (dump_reply) {
+                    // Whatever the dump didn't report is gone
+                    dumping_ = false;
+                    auto stale = addresses_;
+                    for (const auto& address : stale) {
+                        if (!dumped_.count(address))
+                            update(address, false);
+                    }
+                }
+                continue;
+            }
+            if (h->nlmsg_type != RTM_NEWADDR && h->nlmsg_type != RTM_DELADDR)
+                continue;
+
+            auto msg = static_cast<const ifaddrmsg*>(NLMSG_DATA(h));
+            if (msg->ifa_family != AF_INET)
+                continue;
+
+            // IFA_LOCAL is the interface's own address, IFA_ADDRESS the peer on point to point links
+            const in_addr* local   = nullptr;
+            const in_addr* address = nullptr;
+            int attr_length        = int(IFA_PAYLOAD(h));
+            for (auto a = IFA_RTA(msg); RTA_OK(a, attr_length); a = RTA_NEXT(a, attr_length)) {
+                if (a->rta_type == IFA_LOCAL)
+                    local = static_cast<const in_addr*>(RTA_DATA(a));
+                else if (a->rta_type == IFA_ADDRESS)
+                    address = static_cast<const in_addr*>(RTA_DATA(a));
+            }
+            if (local)
+                address = local;
+            if (!address)
+                continue;
+
+            asio::ip::address_v4 addr(ntohl(address->s_addr));
+            const bool added = (h->nlmsg_type == RTM_NEWADDR);
+            if (dump_reply && added)
+                dumped_.insert(addr);
+            update(addr, added);
+        }
+    }
+#else
+    address_monitor::address_monitor(asio::io_context& io_context, on_change_type on_change)
+        : on_change_(on_change), timer_(io_context)
+    {
+    }
+
+    void address_monitor::start() { poll(); }
+
+    void address_monitor::poll()
+    {
+        set<asio::ip::address_v4> current;
+        for (const auto& address : utility::get_interface_addresses()) {
+            if (address.is_v4())
+                current.insert(address.to_v4());
+        }
+        auto previous = addresses_;
+        for (const auto& address : previous) {
+            if (!current.count(address))
+                update(address, false);
+        }
+        for (const auto& address : current)
+            update(address, true);
+
+        timer_.expires_after(chrono::seconds(5));
+        timer_.async_wait([this](error_code ec) {
+            if (!ec)
+                poll();
+        });
+    }
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <asio.hpp>
+#include <asio/steady_timer.hpp>
+#include <array>
+#include <functional>
+#include <set>
+
+namespace netmon
+{
+    // Reports IPv4 interface addresses as they appear and disappear. On Linux an rtnetlink
+    // socket on the io_context is told about changes by the kernel, elsewhere the interfaces
+    // are polled. The addresses present at start() are reported as added.
+    struct address_monitor {
+        typedef std::function<void(const asio::ip::address_v4& address, bool added)> on_change_type;
+
+        address_monitor(asio::io_context& io_context, on_change_type on_change);
+
+        void start();
+
+    private:
+        void update(const asio::ip::address_v4& address, bool added);
+
+        on_change_type on_change_;
+        std::set<asio::ip::address_v4> addresses_;
+#ifdef __linux__
+        void request_dump();
+        void do_receive();
+        void handle_messages(size_t length);
+
+        asio::generic::raw_protocol::socket socket_;
+        std::array<uint32_t, 2048> buffer_;  // 8 KiB, aligned for nlmsghdr
+        uint32_t dump_sequence_{};
+        bool dumping_{};
+        std::set<asio::ip::address_v4> dumped_;  // Addresses seen in the current dump
+#else
+        void poll();
+
+        asio::steady_timer timer_;
+#endif
+    };
+}
@@ -0,0 +1,550 @@
+#include "program.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    struct header {
+        uint32_t instructions_;
+        uint32_t strings_;
+        uint32_t total_time_;
+        uint32_t version_;  // 0 for programs with absolute times and no repeats
+    };
+
+    const uint32_t format_version = 1;
+
+    // The program before repeats existed: times of the actions are absolute.
+    struct legacy_instruction {
+        uint32_t time_;
+        program::opcode op_;
+        uint8_t arg_;
+        uint16_t operand_;
+    };
+
+    bool valid_name(const string& name)
+    {
+        if (name.empty() || name.size() > program::compiled_program::max_name)
+            return false;
+        for (char c : name) {
+            if (!isalnum(uint8_t(c)) && c != '_')
+                return false;
+        }
+        return true;
+    }
+}
+
+namespace program
+{
+    void compiled_program::clear()
+    {
+        code_.clear();
+        strings_.clear();
+        string_index_.clear();
+        parameters_.clear();
+        open_.assign(1, totals{});
+        counts_.clear();
+        blocks_.clear();
+        total_time_ = 0;
+        step_count_ = 0;
+    }
+
+    void compiled_program::advance(uint32_t ms) { insert(code_.size(), make_wait(ms)); }
+
+    void compiled_program::advance(const string& parameter) { insert(code_.size(), make_wait(parameter)); }
+
+    void compiled_program::add_audio(const string& path) { insert(code_.size(), make_audio(path)); }
+
+    void compiled_program::add_move(bool position, uint16_t lanes) { insert(code_.size(), make_move(position, lanes)); }
+
+    void compiled_program::begin_repeat(uint32_t count)
+    {
+        if (counts_.size() >= max_depth)
+            throw runtime_error("Syntax");
+        blocks_.push_back(block{code_.size(), string::npos});
+        code_.push_back(make_repeat(count));
+        open_.push_back(totals{});
+        counts_.push_back(count);
+    }
+
+    void compiled_program::end_repeat()
+    {
+        if (counts_.empty())
+            throw runtime_error("Syntax");
+        // The totals already count the block as closed
+        auto body  = open_.back();
+        auto count = counts_.back();
+        open_.pop_back();
+        counts_.pop_back();
+        open_.back().time_ += count * body.time_;
+        open_.back().steps_ += count * body.steps_;
+        // The innermost open block begins last
+        for (auto b = blocks_.rbegin(); b != blocks_.rend(); ++b) {
+            if (b->end_ == string::npos) {
+                b->end_ = code_.size();
+                break;
+            }
+        }
+        code_.push_back(make_end());
+    }
+
+    void compiled_program::set_parameter(const string& name, uint32_t ms)
+    {
+        if (!valid_name(name))
+            throw runtime_error("Syntax");
+        for (auto& param : parameters_) {
+            if (param.first != name)
+                continue;
+            const auto previous = param.second;
+            param.second        = ms;
+            if (!update_totals()) {
+                param.second = previous;
+                update_totals();
+                throw runtime_error("Syntax");
+            }
+            return;
+        }
+        if (parameters_.size() > UINT16_MAX)
+            throw runtime_error("Syntax");
+        // Not waited on yet, so the totals stay
+        parameters_.emplace_back(name, ms);
+    }
+
+    void compiled_program::insert(size_t index, const instruction& instr)
+    {
+        if (index > code_.size())
+            throw runtime_error("Syntax");
+        if (is_block(instr))
+            return restructure(index, &instr, true);
+
+        const auto w = weight(instr);
+        account(index, w, true, true);
+        if (!close_totals()) {
+            account(index, w, false, true);
+            throw runtime_error("Syntax");
+        }
+        code_.insert(code_.begin() + index, instr);
+        for (auto& b : blocks_) {
+            if (b.begin_ >= index)
+                ++b.begin_;
+            if (b.end_ != string::npos && b.end_ >= index)
+                ++b.end_;
+        }
+    }
+
+    void compiled_program::replace(size_t index, const instruction& instr)
+    {
+        if (index >= code_.size())
+            throw runtime_error("Syntax");
+        if (is_block(instr) || is_block(code_[index]))
+            return restructure(index, &instr, false);
+
+        const auto previous = weight(code_[index]);
+        const auto w        = weight(instr);
+        account(index, previous, false, false);
+        account(index, w, true, false);
+        if (!close_totals()) {
+            account(index, w, false, false);
+            account(index, previous, true, false);
+            close_totals();
+            throw runtime_error("Syntax");
+        }
+        code_[index] = instr;
+    }
+
+    void compiled_program::erase(size_t index)
+    {
+        if (index >= code_.size())
+            throw runtime_error("Syntax");
+        if (is_block(code_[index]))
+            return restructure(index, nullptr, false);
+
+        // Totals only shrink, so they still fit
+        account(index, weight(code_[index]), false, false);
+        close_totals();
+        code_.erase(code_.begin() + index);
+        for (auto& b : blocks_) {
+            if (b.begin_ > index)
+                --b.begin_;
+            if (b.end_ != string::npos && b.end_ > index)
+                --b.end_;
+        }
+    }
+
+    void compiled_program::shift(size_t index, int64_t ms)
+    {
+        if (index >= code_.size())
+            throw runtime_error("Syntax");
+        size_t at = index;
+        if (code_[at].op_ != opcode::wait && at > 0)
+            --at;
+        if (code_[at].op_ != opcode::wait) {
+            // No wait to change, a delay gets one of its own
+            if (ms < 0 || ms > UINT32_MAX)
+                throw runtime_error("Syntax");
+            return insert(index, make_wait(uint32_t(ms)));
+        }
+        const int64_t time = int64_t(code_[at].value_) + ms;
+        if (time < 0 || time > UINT32_MAX)
+            throw runtime_error("Syntax");
+        replace(at, make_wait(uint32_t(time)));
+    }
+
+    instruction compiled_program::make_wait(const string& parameter) const
+    {
+        for (size_t i = 0; i < parameters_.size(); ++i) {
+            if (parameters_[i].first == parameter)
+                return instruction{0, opcode::wait_param, 0, uint16_t(i)};
+        }
+        throw runtime_error("Syntax");
+    }
+
+    instruction compiled_program::make_audio(const string& path)
+    {
+        return instruction{0, opcode::play_audio, 0, intern(path)};
+    }
+
+    instruction compiled_program::make_repeat(uint32_t count)
+    {
+        if (count == 0)
+            throw runtime_error("Syntax");
+        return instruction{count, opcode::repeat, 0, 0};
+    }
+
+    uint64_t compiled_program::hash() const
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (auto c : serialize()) {
+            h ^= uint8_t(c);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    string compiled_program::serialize() const
+    {
+        vector<uint16_t> order;
+        const auto index = string_order(order);
+        auto code        = code_;
+        for (auto& instr : code) {
+            if (instr.op_ == opcode::play_audio)
+                instr.operand_ = index[instr.operand_];
+        }
+
+        header h{uint32_t(code.size()), uint32_t(order.size()), total_time_, format_version};
+        string s(reinterpret_cast<const char*>(&h), sizeof h);
+        s.append(reinterpret_cast<const char*>(code.data()), code.size() * sizeof(instruction));
+        for (auto i : order)
+            s.append(strings_[i].c_str(), strings_[i].size() + 1);
+        const auto count = uint32_t(parameters_.size());
+        s.append(reinterpret_cast<const char*>(&count), sizeof count);
+        for (const auto& param : parameters_) {
+            s.append(reinterpret_cast<const char*>(&param.second), sizeof param.second);
+            s.append(param.first.c_str(), param.first.size() + 1);
+        }
+        return s;
+    }
+
+    bool compiled_program::deserialize(const char* data, size_t size)
+    {
+        header h;
+        if (size < sizeof h)
+            return false;
+        memcpy(&h, data, sizeof h);
+        const size_t code_bytes = size_t(h.instructions_) * sizeof(instruction);
+        if ((h.version_ != 0 && h.version_ != format_version) || h.strings_ > size_t(UINT16_MAX) + 1 ||
+            code_bytes > size - sizeof h)
+            return false;
+
+        compiled_program p;
+        const char* str = data + sizeof h + code_bytes;
+        const char* end = data + size;
+        for (uint32_t i = 0; i < h.strings_; ++i) {
+            auto nul = static_cast<const char*>(memchr(str, 0, size_t(end - str)));
+            if (!nul)
+                return false;
+            p.intern(string(str, nul));
+            str = nul + 1;
+        }
+        if (p.strings_.size() != h.strings_)
+            return false;
+
+        if (h.version_ == 0) {
+            // Actions in time order, converted to waits between them
+            vector<legacy_instruction> legacy(h.instructions_);
+            memcpy(legacy.data(), data + sizeof h, code_bytes);
+            uint32_t time = 0;
+            for (const auto& instr : legacy) {
+                if (instr.time_ < time || instr.time_ > h.total_time_ ||
+                    (instr.op_ == opcode::play_audio && instr.operand_ >= p.strings_.size()) ||
+                    (instr.op_ != opcode::play_audio && instr.op_ != opcode::move_target))
+                    return false;
+                if (instr.time_ > time)
+                    p.code_.push_back(instruction{instr.time_ - time, opcode::wait, 0, 0});
+                p.code_.push_back(instruction{0, instr.op_, instr.arg_, instr.operand_});
+                time = instr.time_;
+            }
+            if (h.total_time_ > time)
+                p.code_.push_back(instruction{h.total_time_ - time, opcode::wait, 0, 0});
+        } else {
+            p.code_.resize(h.instructions_);
+            memcpy(p.code_.data(), data + sizeof h, code_bytes);
+
+            uint32_t count;
+            if (size_t(end - str) < sizeof count)
+                return false;
+            memcpy(&count, str, sizeof count);
+            str += sizeof count;
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t ms;
+                if (size_t(end - str) < sizeof ms)
+                    return false;
+                memcpy(&ms, str, sizeof ms);
+                str += sizeof ms;
+                auto nul = static_cast<const char*>(memchr(str, 0, size_t(end - str)));
+                if (!nul || p.parameters_.size() > UINT16_MAX)
+                    return false;
+                p.parameters_.emplace_back(string(str, nul), ms);
+                str = nul + 1;
+            }
+
+            // Instructions must refer to strings and parameters that exist, and blocks nest
+            size_t depth = 0;
+            for (const auto& instr : p.code_) {
+                switch (instr.op_) {
+                case opcode::play_audio:
+                    if (instr.operand_ >= p.strings_.size())
+                        return false;
+                    break;
+                case opcode::move_target:
+                case opcode::wait:
+                    break;
+                case opcode::wait_param:
+                    if (instr.operand_ >= p.parameters_.size())
+                        return false;
+                    break;
+                case opcode::repeat:
+                    if (instr.value_ == 0 || ++depth > max_depth)
+                        return false;
+                    break;
+                case opcode::end_repeat:
+                    if (depth-- == 0)
+                        return false;
+                    break;
+                default:
+                    return false;
+                }
+            }
+        }
+
+        if (!p.update_totals() || p.total_time_ != h.total_time_)
+            return false;
+        *this = move(p);
+        return true;
+    }
+
+    uint16_t compiled_program::intern(const string& s)
+    {
+        auto it = string_index_.find(s);
+        if (it != string_index_.end())
+            return it->second;
+        // Edits leave strings behind, they only take a pass over the program once the table is full
+        if (strings_.size() > UINT16_MAX)
+            compact_strings();
+        if (strings_.size() > UINT16_MAX)
+            throw runtime_error("Syntax");
+        auto index = uint16_t(strings_.size());
+        strings_.push_back(s);
+        string_index_.emplace(s, index);
+        return index;
+    }
+
+    vector<uint16_t> compiled_program::string_order(vector<uint16_t>& order) const
+    {
+        vector<uint16_t> index(strings_.size());
+        vector<bool> used(strings_.size());
+        for (const auto& instr : code_) {
+            if (instr.op_ != opcode::play_audio || used[instr.operand_])
+                continue;
+            used[instr.operand_]  = true;
+            index[instr.operand_] = uint16_t(order.size());
+            order.push_back(instr.operand_);
+        }
+        return index;
+    }
+
+    void compiled_program::compact_strings()
+    {
+        vector<uint16_t> order;
+        const auto index = string_order(order);
+        for (auto& instr : code_) {
+            if (instr.op_ == opcode::play_audio)
+                instr.operand_ = index[instr.operand_];
+        }
+        vector<string> strings;
+        strings.reserve(order.size());
+        for (auto i : order)
+            strings.push_back(move(strings_[i]));
+        strings_ = move(strings);
+        string_index_.clear();
+        for (size_t i = 0; i < strings_.size(); ++i)
+            string_index_.emplace(strings_[i], uint16_t(i));
+    }
+
+    compiled_program::totals compiled_program::weight(const instruction& instr) const
+    {
+        switch (instr.op_) {
+        case opcode::play_audio:
+        case opcode::move_target:
+            return totals{0, 1};
+        case opcode::wait:
+            return totals{instr.value_, 0};
+        case opcode::wait_param:
+            return totals{parameters_[instr.operand_].second, 0};
+        default:
+            return totals{};
+        }
+    }
+
+    void compiled_program::account(size_t index, const totals& w, bool add, bool inserted)
+    {
+        // Closed blocks around the instruction repeat it, open ones are levels of their own
+        uint64_t factor = 1;
+        size_t level    = 0;
+        for (const auto& b : blocks_) {
+            if (b.begin_ >= index)
+                break;
+            if (b.end_ == string::npos)
+                ++level;
+            else if (b.end_ > index || (inserted && b.end_ == index))
+                // Past the largest total any weight is too much, the cap keeps this from wrapping
+                factor = min(factor * code_[b.begin_].value_, uint64_t(UINT32_MAX) + 1);
+        }
+        auto& t = open_[level];
+        if (add) {
+            t.time_ += factor * w.time_;
+            t.steps_ += factor * w.steps_;
+        } else {
+            t.time_ -= factor * w.time_;
+            t.steps_ -= factor * w.steps_;
+        }
+    }
+
+    void compiled_program::restructure(size_t index, const instruction* instr, bool inserted)
+    {
+        const auto previous = code_;
+        if (inserted)
+            code_.insert(code_.begin() + index, *instr);
+        else if (instr)
+            code_[index] = *instr;
+        else
+            code_.erase(code_.begin() + index);
+        if (!update_totals()) {
+            code_ = previous;
+            update_totals();
+            throw runtime_error("Syntax");
+        }
+    }
+
+    bool compiled_program::update_totals()
+    {
+        open_.assign(1, totals{});
+        counts_.clear();
+        blocks_.clear();
+        vector<size_t> open_blocks;
+        for (size_t i = 0; i < code_.size(); ++i) {
+            const auto& instr = code_[i];
+            switch (instr.op_) {
+            case opcode::repeat:
+                if (counts_.size() >= max_depth)
+                    return false;
+                open_blocks.push_back(blocks_.size());
+                blocks_.push_back(block{i, string::npos});
+                open_.push_back(totals{});
+                counts_.push_back(instr.value_);
+                break;
+            case opcode::end_repeat: {
+                if (counts_.empty())
+                    return false;
+                blocks_[open_blocks.back()].end_ = i;
+                open_blocks.pop_back();
+                auto body = open_.back();
+                open_.pop_back();
+                open_.back().time_ += counts_.back() * body.time_;
+                open_.back().steps_ += counts_.back() * body.steps_;
+                counts_.pop_back();
+            } break;
+            default: {
+                auto w = weight(instr);
+                open_.back().time_ += w.time_;
+                open_.back().steps_ += w.steps_;
+            }
+            }
+            // Totals only grow, as counts are at least 1, so a partial one too large is final
+            if (open_.back().time_ > UINT32_MAX || open_.back().steps_ > UINT32_MAX)
+                return false;
+        }
+        return close_totals();
+    }
+
+    // Totals of the program as if its open blocks were closed now.
+    bool compiled_program::close_totals()
+    {
+        auto t = open_.back();
+        for (size_t level = open_.size() - 1; level > 0; --level) {
+            if (t.time_ > UINT32_MAX || t.steps_ > UINT32_MAX)
+                return false;
+            t.time_  = open_[level - 1].time_ + counts_[level - 1] * t.time_;
+            t.steps_ = open_[level - 1].steps_ + counts_[level - 1] * t.steps_;
+        }
+        if (t.time_ > UINT32_MAX || t.steps_ > UINT32_MAX)
+            return false;
+        total_time_ = uint32_t(t.time_);
+        step_count_ = uint32_t(t.steps_);
+        return true;
+    }
+
+    bool cursor::next(step& s)
+    {
+        const auto& code = program_->code();
+        // Blocks still open at the end are closed there
+        while (pc_ < code.size() || !frames_.empty()) {
+            const auto* instr = pc_ < code.size() ? &code[pc_++] : nullptr;
+            if (!instr || instr->op_ == opcode::end_repeat) {
+                auto& f = frames_.back();
+                if (index_ == f.index_) {
+                    // No actions in the body, the remaining iterations only take time
+                    time_ += f.left_ * (time_ - f.time_);
+                    frames_.pop_back();
+                } else if (f.left_ > 0) {
+                    --f.left_;
+                    pc_ = f.begin_;
+                } else
+                    frames_.pop_back();
+                continue;
+            }
+            switch (instr->op_) {
+            case opcode::play_audio:
+            case opcode::move_target:
+                s = step{time_, index_++, instr->op_, instr->arg_, instr->operand_};
+                return true;
+            case opcode::wait:
+                time_ += instr->value_;
+                break;
+            case opcode::wait_param:
+                time_ += program_->parameters()[instr->operand_].second;
+                break;
+            case opcode::repeat:
+                frames_.push_back(frame{pc_, instr->value_ - 1, time_, index_});
+                break;
+            case opcode::end_repeat:
+                break;
+            }
+        }
+        return false;
+    }
+}
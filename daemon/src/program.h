@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace program
+{
+    enum class opcode : uint8_t {
+        play_audio,   // operand_ is an index into the string table
+        move_target,  // arg_ is the position, operand_ the mask of lanes to move
+        wait,         // value_ is the time in ms
+        wait_param,   // operand_ is an index into the parameter table
+        repeat,       // value_ is the repeat count of the block up to the matching end_repeat
+        end_repeat,
+    };
+
+    // One instruction of a program, 8 bytes so long programs stay compact and cache friendly.
+    struct instruction {
+        uint32_t value_;  // Operand of waits and repeats
+        opcode op_;
+        uint8_t arg_;
+        uint16_t operand_;
+    };
+
+    // One action of the expanded program.
+    struct step {
+        uint32_t time_;   // Absolute time in ms from program start
+        uint32_t index_;  // Position in the expanded program
+        opcode op_;
+        uint8_t arg_;
+        uint16_t operand_;
+    };
+
+    // A program compiled from T/A/M commands, repeat blocks and parameters: a flat array of
+    // instructions with relative waits, plus tables of interned audio paths and of named
+    // parameters. Repeats aren't unrolled, the program is expanded while it runs by a cursor.
+    // Its total time and step count are kept up to date as it is built.
+    struct compiled_program {
+        enum { max_depth = 8, max_name = 31 };
+
+        void clear();
+
+        // T: advance the time of subsequent instructions, by a fixed time or a parameter.
+        void advance(uint32_t ms);
+        void advance(const std::string& parameter);
+        void add_audio(const std::string& path);
+        void add_move(bool position, uint16_t lanes);
+        // Instructions up to the matching end_repeat() run `count` times. A block still open
+        // at the end of the program is closed there.
+        void begin_repeat(uint32_t count);
+        void end_repeat();
+        // Defines a parameter, or changes it and so the time of every wait on it.
+        void set_parameter(const std::string& name, uint32_t ms);
+
+        // Edits by index into the instructions, of which each T, A, M, [ and ] adds one. The
+        // totals are updated from the edited instruction and the blocks around it; only edits
+        // of the blocks themselves take a pass over the program. An invalid edit throws and
+        // leaves the program as it was.
+        void insert(size_t index, const instruction& instr);
+        void replace(size_t index, const instruction& instr);
+        void erase(size_t index);
+        // Delays the instruction at `index` and all after it by `ms`, or advances them if
+        // negative, by changing the wait at or just before it.
+        void shift(size_t index, int64_t ms);
+
+        // Instructions as added by the commands, for the edits.
+        static instruction make_wait(uint32_t ms) { return instruction{ms, opcode::wait, 0, 0}; }
+        instruction make_wait(const std::string& parameter) const;
+        instruction make_audio(const std::string& path);
+        static instruction make_move(bool position, uint16_t lanes)
+        {
+            return instruction{0, opcode::move_target, uint8_t(position ? 1 : 0), lanes};
+        }
+        static instruction make_repeat(uint32_t count);
+        static instruction make_end() { return instruction{0, opcode::end_repeat, 0, 0}; }
+
+        bool empty() const { return code_.empty(); }
+        size_t size() const { return code_.size(); }
+        const instruction& operator[](size_t index) const { return code_[index]; }
+        const std::vector<instruction>& code() const { return code_; }
+
+        const std::string& string_at(uint16_t index) const { return strings_[index]; }
+        const std::vector<std::string>& strings() const { return strings_; }
+        const std::vector<std::pair<std::string, uint32_t>>& parameters() const { return parameters_; }
+
+        // Total program time in ms, including trailing delays.
+        uint32_t total_time() const { return total_time_; }
+        // Number of actions in the expanded program.
+        uint32_t step_count() const { return step_count_; }
+
+        // 64 bit FNV-1a of the serialized program, equal programs have equal hashes however
+        // they were built or edited.
+        uint64_t hash() const;
+
+        // Compact binary form in host byte order, used by the program library: a header with
+        // the instruction count, string count, total time and format version, the
+        // instructions, the strings NUL terminated, then the parameter count and each
+        // parameter's value followed by its name NUL terminated. The strings are those the
+        // instructions use, in the order of their first use.
+        std::string serialize() const;
+        // Replaces the program with a serialized one. Returns false, leaving the program
+        // unchanged, if `data` is malformed. Programs stored before repeats existed, with
+        // absolute times, are converted.
+        bool deserialize(const char* data, size_t size);
+
+    private:
+        // Time and actions of a block, its body once while it is open.
+        struct totals {
+            uint64_t time_{};
+            uint64_t steps_{};
+        };
+
+        // A repeat block by the index of its repeat and end_repeat, the end is npos while open.
+        struct block {
+            size_t begin_;
+            size_t end_;
+        };
+
+        uint16_t intern(const std::string& s);
+        // Indices of the used strings in the order of first use into `order`. Returns the
+        // position in `order` of each string, 0 for strings no instruction uses.
+        std::vector<uint16_t> string_order(std::vector<uint16_t>& order) const;
+        // Drops the strings no instruction uses any more, left behind by edits.
+        void compact_strings();
+        totals weight(const instruction& instr) const;
+        static bool is_block(const instruction& instr)
+        {
+            return instr.op_ == opcode::repeat || instr.op_ == opcode::end_repeat;
+        }
+        // Adds or removes the weight of an instruction at `index` to the totals of its level,
+        // multiplied by the blocks around it. An inserted instruction at the index of an
+        // end_repeat is in that block.
+        void account(size_t index, const totals& w, bool add, bool inserted);
+        // Replaces the instruction at `index`, or inserts or erases it, and recomputes the
+        // totals. Reverts and throws if the program would be invalid.
+        void restructure(size_t index, const instruction* instr, bool inserted);
+        // Recomputes the blocks and totals from the instructions, false if the blocks don't
+        // nest or the totals don't fit.
+        bool update_totals();
+        bool close_totals();
+
+        std::vector<instruction> code_;
+        std::vector<std::string> strings_;
+        std::unordered_map<std::string, uint16_t> string_index_;
+        std::vector<std::pair<std::string, uint32_t>> parameters_;
+        std::vector<totals> open_{totals{}};  // Top level and open blocks, innermost last
+        std::vector<uint32_t> counts_;        // Repeat count of each open block
+        std::vector<block> blocks_;           // In the order they begin
+        uint32_t total_time_{};
+        uint32_t step_count_{};
+    };
+
+    // Walks the expanded program from the start without unrolling it; memory is bounded by
+    // the nesting depth. The program must not change meanwhile.
+    struct cursor {
+        explicit cursor(const compiled_program& p) : program_(&p) {}
+
+        // The next action, false after the last.
+        bool next(step& s);
+
+    private:
+        struct frame {
+            size_t begin_;    // First instruction of the body
+            uint32_t left_;   // Iterations after the current one
+            uint32_t time_;   // At the start of the block
+            uint32_t index_;  // Of the first action of the block
+        };
+
+        const compiled_program* program_;
+        size_t pc_{};
+        uint32_t time_{};
+        uint32_t index_{};
+        std::vector<frame> frames_;
+    };
+}
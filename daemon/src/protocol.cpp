@@ -0,0 +1,132 @@
+#include "protocol.h"
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    const size_t max_number_length = 32;
+
+    // Copies the slice to a terminated buffer for the C conversion functions.
+    void copy_number(const protocol::slice& s, char (&buf)[max_number_length + 1])
+    {
+        if (s.empty() || s.size() > max_number_length)
+            throw invalid_argument("number");
+        memcpy(buf, s.begin(), s.size());
+        buf[s.size()] = '\0';
+    }
+}
+
+namespace protocol
+{
+    const char* to_string(status s)
+    {
+        static const char* const names[] = {"OK",
+                                            "Busy",
+                                            "Executing",
+                                            "Syntax",
+                                            "Empty",
+                                            "UnknownCommand",
+                                            "Target",
+                                            "Late",
+                                            "Clock",
+                                            "Library",
+                                            "UnknownProgram",
+                                            "Audio"};
+        return size_t(s) < sizeof names / sizeof names[0] ? names[size_t(s)] : "Unknown";
+    }
+
+    namespace binary
+    {
+        void encode(string& out, opcode op, status st, uint32_t tag, const char* payload, size_t size)
+        {
+            put_u16(out, uint16_t(size));
+            out.push_back(char(op));
+            out.push_back(char(st));
+            put_u32(out, tag);
+            out.append(payload, size);
+        }
+
+        void encode_state(string& out, const state& s)
+        {
+            put_u32(out, uint32_t(s.exec_ms_));
+            put_u32(out, s.total_ms_);
+            put_u32(out, s.positions_);
+            put_u32(out, s.step_);
+            out.push_back(char(s.lanes_));
+            out.push_back(char(s.flags_));
+            put_u16(out, 0);
+        }
+
+        bool decode_state(slice payload, state& s)
+        {
+            if (payload.size() < state::size)
+                return false;
+            const char* p = payload.begin();
+            s.exec_ms_    = int32_t(get_u32(p));
+            s.total_ms_   = get_u32(p + 4);
+            s.positions_  = get_u32(p + 8);
+            s.step_       = get_u32(p + 12);
+            s.lanes_      = uint8_t(p[16]);
+            s.flags_      = uint8_t(p[17]);
+            return true;
+        }
+
+        header decode_header(const char* p)
+        {
+            return header{get_u16(p), opcode(uint8_t(p[2])), status(uint8_t(p[3])), get_u32(p + 4)};
+        }
+    }
+
+    slice slice::trim() const
+    {
+        const char* b = begin();
+        const char* e = end();
+        while (b != e && isspace(static_cast<unsigned char>(*b)))
+            ++b;
+        while (e != b && isspace(static_cast<unsigned char>(e[-1])))
+            --e;
+        return slice{b, size_t(e - b)};
+    }
+
+    float slice::to_float() const
+    {
+        char buf[max_number_length + 1];
+        copy_number(trim(), buf);
+        char* last = nullptr;
+        float f    = strtof(buf, &last);
+        if (last == buf || *last != '\0' || !isfinite(f))
+            throw invalid_argument("number");
+        return f;
+    }
+
+    double slice::to_double() const
+    {
+        char buf[max_number_length + 1];
+        copy_number(trim(), buf);
+        char* last = nullptr;
+        double d   = strtod(buf, &last);
+        if (last == buf || *last != '\0' || !isfinite(d))
+            throw invalid_argument("number");
+        return d;
+    }
+
+    int slice::to_int(int base) const
+    {
+        char buf[max_number_length + 1];
+        copy_number(trim(), buf);
+        char* last = nullptr;
+        errno      = 0;
+        long l     = strtol(buf, &last, base);
+        if (last == buf || *last != '\0' || errno == ERANGE || l < INT_MIN || l > INT_MAX)
+            throw invalid_argument("number");
+        return int(l);
+    }
+}
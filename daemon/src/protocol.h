@@ -0,0 +1,306 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace protocol
+{
+    // Result of a command. The text protocol reports failures as ERROR=<name>, the binary
+    // protocol in the status byte of the reply.
+    enum class status : uint8_t {
+        ok,
+        busy,
+        executing,
+        syntax,
+        empty,
+        unknown_command,
+        target,
+        late,
+        clock,
+        library,
+        unknown_program,
+        audio,
+    };
+    // Name in the text protocol, e.g. "UnknownCommand".
+    const char* to_string(status s);
+
+    // Non-owning view of (part of) a received command. Only valid during the callback it
+    // was passed to.
+    struct slice {
+        const char* data_{};
+        size_t size_{};
+
+        slice() = default;
+        slice(const char* data, size_t size) : data_(data), size_(size) {}
+
+        bool empty() const { return size_ == 0; }
+        size_t size() const { return size_; }
+        char front() const { return data_[0]; }
+        const char* begin() const { return data_; }
+        const char* end() const { return data_ + size_; }
+
+        slice substr(size_t pos) const { return pos < size_ ? slice{data_ + pos, size_ - pos} : slice{}; }
+        slice substr(size_t pos, size_t len) const
+        {
+            auto s = substr(pos);
+            return slice{s.data_, len < s.size_ ? len : s.size_};
+        }
+        // Index of the first `c`, or size() if not found.
+        size_t find(char c) const
+        {
+            for (size_t i = 0; i < size_; ++i) {
+                if (data_[i] == c)
+                    return i;
+            }
+            return size_;
+        }
+        slice trim() const;
+        std::string str() const { return std::string(data_, size_); }
+
+        // Parse the whole slice as a number, throws std::invalid_argument on failure, for nan
+        // and infinity, and if it is out of the range of the type.
+        float to_float() const;
+        double to_double() const;
+        int to_int(int base = 10) const;
+    };
+
+    // Incremental splitter of the text protocol. Commands are separated by ';' or newline and
+    // may arrive split over any number of reads. Complete commands are handed out as slices of
+    // the read buffer, only an unterminated tail is copied, so memory use is bounded by the
+    // longest single command regardless of how many commands are pipelined.
+    struct command_parser {
+        explicit command_parser(size_t max_command_length = 4096) : max_command_length_(max_command_length)
+        {
+            partial_.reserve(max_command_length_);
+        }
+
+        // Calls on_command(slice) for each complete, trimmed, non-empty command in `data`, and
+        // on_overflow() for each command longer than the maximum length (which is discarded).
+        template <typename OnCommand, typename OnOverflow>
+        void feed(const char* data, size_t length, OnCommand&& on_command, OnOverflow&& on_overflow)
+        {
+            feed(data, length, on_command, on_overflow, [] {});
+        }
+
+        // As above, and calls on_line() after the command ended by each newline, so the caller
+        // can treat a line as a batch however the stream is split.
+        template <typename OnCommand, typename OnOverflow, typename OnLine>
+        void feed(const char* data, size_t length, OnCommand&& on_command, OnOverflow&& on_overflow, OnLine&& on_line)
+        {
+            const char* p   = data;
+            const char* end = data + length;
+            while (p != end) {
+                const char* delim = p;
+                while (delim != end && *delim != ';' && *delim != '\n')
+                    ++delim;
+
+                if (delim == end) {
+                    append_partial(p, size_t(end - p));
+                    return;
+                }
+
+                if (overflowed_) {
+                    overflowed_ = false;
+                    on_overflow();
+                } else if (!partial_.empty()) {
+                    append_partial(p, size_t(delim - p));
+                    if (overflowed_) {
+                        overflowed_ = false;
+                        on_overflow();
+                    } else {
+                        emit(slice{partial_.data(), partial_.size()}, on_command);
+                    }
+                } else {
+                    emit(slice{p, size_t(delim - p)}, on_command);
+                }
+                partial_.clear();
+                if (*delim == '\n')
+                    on_line();
+                p = delim + 1;
+            }
+        }
+
+        // True if an unterminated command is waiting for more data.
+        bool has_partial() const { return !partial_.empty() || overflowed_; }
+
+        void reset()
+        {
+            partial_.clear();
+            overflowed_ = false;
+        }
+
+    private:
+        template <typename OnCommand>
+        static void emit(slice cmd, OnCommand& on_command)
+        {
+            cmd = cmd.trim();
+            if (!cmd.empty())
+                on_command(cmd);
+        }
+
+        void append_partial(const char* data, size_t length)
+        {
+            if (overflowed_)
+                return;
+            if (partial_.size() + length > max_command_length_) {
+                overflowed_ = true;
+                partial_.clear();
+                return;
+            }
+            partial_.append(data, length);
+        }
+
+        const size_t max_command_length_;
+        std::string partial_;
+        bool overflowed_{};
+    };
+
+    // Optional binary framing for machine clients, chosen by sending `magic` as the very first
+    // bytes of a connection (a text command never starts with NUL). Every frame is an 8 byte
+    // header and `length_` bytes of payload, integers are little endian. A reply carries the
+    // opcode and tag of its request and the status of the command; unlike the text protocol
+    // every request is answered on its own, also after an error.
+    namespace binary
+    {
+        const char magic[4]      = {'\0', 'T', 'D', 'B'};
+        const uint8_t version    = 1;
+        const size_t header_size = 8;
+        const size_t max_payload = 4096;
+
+        enum class opcode : uint8_t {
+            hello     = 0x00,  // Sent by the daemon when the magic is received: uint8 version
+            clear     = 0x01,
+            advance   = 0x02,  // uint32 ms
+            add_audio = 0x03,  // Path
+            add_move  = 0x04,  // uint8 position, uint8 0, uint16 lanes (0 for all)
+            play      = 0x05,  // Path
+            move      = 0x06,  // As add_move
+            run       = 0x07,  // Empty to run now, or int64 start in us of the shared timebase
+            stop      = 0x08,
+            query     = 0x09,  // Reply: state
+            lease     = 0x0a,  // Empty or resume token. Reply: 16 character token, state
+            subscribe = 0x0b,  // uint8 on
+            exit      = 0x0c,
+            arm       = 0x0d,  // Reply: uint16 spacing warnings, uint16 audio warnings
+            repeat    = 0x0e,  // uint32 count
+            end       = 0x0f,
+            parameter = 0x10,  // uint32 ms, name
+            wait      = 0x11,  // Parameter name
+            insert    = 0x12,  // uint32 index, uint8 opcode and payload of advance to wait
+            replace   = 0x13,  // As insert
+            erase     = 0x14,  // uint32 index
+            shift     = 0x15,  // uint32 index, int32 ms
+            event     = 0x80,  // Sent by the daemon: event text as after EVENT= in the text protocol
+        };
+
+        struct header {
+            uint16_t length_;
+            opcode opcode_;
+            status status_;
+            uint32_t tag_;
+        };
+
+        // Program and target state in query and lease replies, 20 bytes on the wire.
+        struct state {
+            enum { size = 20, running = 1, has_program = 2 };
+            int32_t exec_ms_;  // -1 if not running
+            uint32_t total_ms_;
+            uint32_t positions_;  // Bit per lane, set if facing front
+            uint32_t step_;       // Index of the next step
+            uint8_t lanes_;
+            uint8_t flags_;
+        };
+
+        inline void put_u16(std::string& out, uint16_t v)
+        {
+            out.push_back(char(v & 0xff));
+            out.push_back(char(v >> 8));
+        }
+        inline void put_u32(std::string& out, uint32_t v)
+        {
+            put_u16(out, uint16_t(v & 0xffff));
+            put_u16(out, uint16_t(v >> 16));
+        }
+        inline void put_u64(std::string& out, uint64_t v)
+        {
+            put_u32(out, uint32_t(v & 0xffffffff));
+            put_u32(out, uint32_t(v >> 32));
+        }
+        inline uint16_t get_u16(const char* p)
+        {
+            return uint16_t(uint8_t(p[0]) | (uint8_t(p[1]) << 8));
+        }
+        inline uint32_t get_u32(const char* p) { return get_u16(p) | (uint32_t(get_u16(p + 2)) << 16); }
+        inline uint64_t get_u64(const char* p) { return get_u32(p) | (uint64_t(get_u32(p + 4)) << 32); }
+
+        // Appends a frame to `out`, `size` must be at most max_payload.
+        void encode(std::string& out, opcode op, status st, uint32_t tag, const char* payload, size_t size);
+        void encode_state(std::string& out, const state& s);
+        // Returns false if `payload` is too short.
+        bool decode_state(slice payload, state& s);
+        header decode_header(const char* p);
+
+        // Incremental splitter of a binary stream. Like the text parser, complete frames are
+        // handed out as slices of the read buffer and only a frame split over reads is copied.
+        // Streams to the daemon start with the magic, replies from it don't.
+        struct frame_parser {
+            explicit frame_parser(bool expect_magic = true) : magic_matched_(expect_magic ? 0 : sizeof magic)
+            {
+                partial_.reserve(header_size + max_payload);
+            }
+
+            // Calls on_frame(header, payload) for each complete frame; the magic is reported as a
+            // hello frame. Returns false if the stream is malformed, it can't be resynchronized.
+            template <typename OnFrame>
+            bool feed(const char* data, size_t length, OnFrame&& on_frame)
+            {
+                const char* p   = data;
+                const char* end = data + length;
+                while (magic_matched_ < sizeof magic) {
+                    if (p == end)
+                        return true;
+                    if (*p++ != magic[magic_matched_++])
+                        return false;
+                    if (magic_matched_ == sizeof magic)
+                        on_frame(header{0, opcode::hello, status::ok, 0}, slice{});
+                }
+
+                while (p != end) {
+                    if (partial_.empty() && size_t(end - p) >= header_size) {
+                        auto h = decode_header(p);
+                        if (h.length_ > max_payload)
+                            return false;
+                        if (size_t(end - p) >= header_size + h.length_) {
+                            on_frame(h, slice{p + header_size, h.length_});
+                            p += header_size + h.length_;
+                            continue;
+                        }
+                    }
+
+                    // Frame split over reads, collect the header first to learn the length
+                    size_t want = header_size;
+                    if (partial_.size() >= header_size)
+                        want += get_u16(partial_.data());
+                    size_t take = want - partial_.size() < size_t(end - p) ? want - partial_.size() : size_t(end - p);
+                    partial_.append(p, take);
+                    p += take;
+                    if (partial_.size() < header_size)
+                        return true;
+                    auto h = decode_header(partial_.data());
+                    if (h.length_ > max_payload)
+                        return false;
+                    if (partial_.size() == header_size + h.length_) {
+                        on_frame(h, slice{partial_.data() + header_size, h.length_});
+                        partial_.clear();
+                    }
+                }
+                return true;
+            }
+
+        private:
+            size_t magic_matched_;
+            std::string partial_;
+        };
+    }
+}
@@ -0,0 +1,64 @@
+#include "realtime.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+#ifdef __linux__
+    // Touches a generous stack area once, so the pages are mapped and locked from now on.
+    void prefault_stack()
+    {
+        enum { size = 256 * 1024 };
+        volatile char stack[size];
+        for (size_t i = 0; i < size; i += 4096)
+            stack[i] = 0;
+        (void)stack;
+    }
+
+    [[noreturn]] void fail(const char* what, int error)
+    {
+        throw runtime_error(string(what) + ": " + strerror(error));
+    }
+#endif
+}
+
+namespace realtime
+{
+    void enter(const settings& s)
+    {
+#ifdef __linux__
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+            fail("mlockall", errno);
+        prefault_stack();
+
+        if (s.cpu_ >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(s.cpu_, &cpus);
+            int error = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+            if (error)
+                fail("CPU pinning", error);
+        }
+
+        sched_param param{};
+        param.sched_priority = s.priority_;
+        int error            = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error)
+            fail("SCHED_FIFO", error);
+#else
+        (void)s;
+        throw runtime_error("Real-time mode is only supported on Linux");
+#endif
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <chrono>
+
+namespace realtime
+{
+    struct settings {
+        int priority_{80};  // SCHED_FIFO priority, 1 to 99
+        int cpu_{-1};       // CPU to pin to, -1 for any
+    };
+
+    // Makes the calling thread a SCHED_FIFO thread, pinned if a CPU is given. Memory is
+    // locked and the stack pre-faulted, so neither paging nor a first stack touch can stall
+    // a step. Threads created afterwards inherit the policy and pinning. Throws if the
+    // system refuses, typically for lack of CAP_SYS_NICE or an RLIMIT_RTPRIO.
+    void enter(const settings& s);
+}
@@ -0,0 +1,98 @@
+#include "scheduler.h"
+
+using namespace std;
+
+namespace scheduler
+{
+    shared_ptr<step_scheduler> step_scheduler::create(asio::io_context& io_context)
+    {
+        return shared_ptr<step_scheduler>(new step_scheduler(io_context));
+    }
+
+    step_scheduler::step_scheduler(asio::io_context& io_context) : timer_(io_context) {}
+
+    void step_scheduler::start(size_t step_count,
+                               offset_type offset_of,
+                               on_step_type on_step,
+                               on_done_type on_done,
+                               clock_type::time_point start_time)
+    {
+        prepare(step_count, move(offset_of), move(on_step), move(on_done));
+        start(start_time);
+    }
+
+    void step_scheduler::prepare(size_t step_count, offset_type offset_of, on_step_type on_step, on_done_type on_done)
+    {
+        stop();
+        step_count_ = step_count;
+        next_step_  = 0;
+        offset_of_  = move(offset_of);
+        on_step_    = move(on_step);
+        on_done_    = move(on_done);
+        prepared_   = true;
+    }
+
+    void step_scheduler::start(clock_type::time_point start_time)
+    {
+        prepared_   = false;
+        start_time_ = start_time;
+        running_    = true;
+        if (next_step_ < step_count_ && start_time_ + offset_of_(next_step_) - spin_ <= clock_type::now())
+            on_timer(generation_);
+        else
+            arm();
+    }
+
+    void step_scheduler::stop()
+    {
+        // Bumping the generation makes any handler already queued by the io_context a no-op.
+        ++generation_;
+        running_  = false;
+        prepared_ = false;
+        timer_.cancel();
+    }
+
+    void step_scheduler::arm()
+    {
+        if (next_step_ >= step_count_) {
+            running_ = false;
+            if (on_done_)
+                on_done_();
+            return;
+        }
+
+        timer_.expires_at(start_time_ + offset_of_(next_step_) - spin_);
+        auto self       = shared_from_this();
+        auto generation = generation_;
+        timer_.async_wait([self, generation](const asio::error_code& ec) {
+            if (ec == asio::error::operation_aborted)
+                return;
+            self->on_timer(generation);
+        });
+    }
+
+    void step_scheduler::on_timer(unsigned generation)
+    {
+        if (generation != generation_)
+            return;
+
+        // Dispatch every step that is due, steps sharing a deadline fire in the same wakeup.
+        auto now = clock_type::now();
+        while (next_step_ < step_count_) {
+            auto scheduled = start_time_ + offset_of_(next_step_);
+            if (scheduled > now) {
+                // Woken early on purpose, the last stretch is waited out by spinning
+                if (scheduled - now > spin_)
+                    break;
+                while (now < scheduled)
+                    now = clock_type::now();
+            }
+            auto index = next_step_++;
+            on_step_(index, now - scheduled);
+            if (generation != generation_)
+                return;  // Stopped or restarted from within the step
+            now = clock_type::now();
+        }
+        arm();
+    }
+}
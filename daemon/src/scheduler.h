@@ -0,0 +1,71 @@
+#pragma once
+
+#include <asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include "timing.h"
+
+namespace scheduler
+{
+    // Dispatches program steps from the io_context using timer deadlines on the daemon clock.
+    // Every deadline is computed from the program start time, so lateness of one
+    // step never accumulates into the next. No threads are created; stopping or
+    // restarting simply invalidates the outstanding wait. Only current_step() may be called
+    // from another thread than the io_context's.
+    struct step_scheduler : std::enable_shared_from_this<step_scheduler> {
+        using clock_type = timing::clock;
+
+        // Offset of step `index` relative to program start.
+        typedef std::function<std::chrono::microseconds(size_t index)> offset_type;
+        // Called for each step when it fires, `lateness` is actual minus scheduled time.
+        typedef std::function<void(size_t index, clock_type::duration lateness)> on_step_type;
+        // Called once when the last step has been dispatched (not when stopped).
+        typedef std::function<void()> on_done_type;
+
+        static std::shared_ptr<step_scheduler> create(asio::io_context& io_context);
+
+        // Steps are scheduled relative to `start_time`, which may be in the future.
+        void start(size_t step_count,
+                   offset_type offset_of,
+                   on_step_type on_step,
+                   on_done_type on_done,
+                   clock_type::time_point start_time = clock_type::now());
+        // Split start: everything but the start time is set up beforehand, so that starting is
+        // only recording the time. Steps already due at the start are dispatched right away,
+        // without a round trip through the timer. A prepared start is cleared by stop().
+        void prepare(size_t step_count, offset_type offset_of, on_step_type on_step, on_done_type on_done);
+        void start(clock_type::time_point start_time);
+        void stop();
+
+        // Wakes up `spin` before each deadline and busy waits the rest, trading CPU time for
+        // the wakeup latency of the timer. Zero (the default) only sleeps.
+        void set_spin(std::chrono::microseconds spin) { spin_ = spin; }
+
+        bool prepared() const { return prepared_; }
+        bool running() const { return running_; }
+        clock_type::time_point start_time() const { return start_time_; }
+        // Index of the next step to be dispatched.
+        size_t current_step() const { return next_step_; }
+
+    private:
+        explicit step_scheduler(asio::io_context& io_context);
+
+        void arm();
+        void on_timer(unsigned generation);
+
+        timing::timer timer_;
+        unsigned generation_{};
+        bool running_{};
+        bool prepared_{};
+        clock_type::time_point start_time_{};
+        std::chrono::microseconds spin_{0};
+        size_t step_count_{};
+        std::atomic<size_t> next_step_{0};
+        offset_type offset_of_;
+        on_step_type on_step_;
+        on_done_type on_done_;
+    };
+}
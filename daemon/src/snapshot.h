@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace snapshot
+{
+    // Sequence lock around a small trivially copyable value: one writer publishes, any number
+    // of readers on any thread get a consistent copy without locking. Readers never block the
+    // writer; a reader that overlaps a write simply copies again. The value is stored as
+    // atomic words so the overlapping copies are not data races.
+    template <typename T>
+    struct seqlock {
+        static_assert(std::is_trivially_copyable<T>::value, "seqlock values are copied bytewise");
+
+        seqlock() { store(T{}); }
+
+        // Only one thread may store.
+        void store(const T& value)
+        {
+            word_type words[word_count] = {};
+            memcpy(words, &value, sizeof(T));
+            auto seq = sequence_.load(std::memory_order_relaxed);
+            sequence_.store(seq + 1, std::memory_order_relaxed);  // Odd while writing
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < word_count; ++i)
+                words_[i].store(words[i], std::memory_order_relaxed);
+            sequence_.store(seq + 2, std::memory_order_release);
+        }
+
+        T load() const
+        {
+            word_type words[word_count];
+            for (;;) {
+                auto before = sequence_.load(std::memory_order_acquire);
+                if (before & 1)
+                    continue;
+                for (size_t i = 0; i < word_count; ++i)
+                    words[i] = words_[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence_.load(std::memory_order_relaxed) == before)
+                    break;
+            }
+            T value;
+            memcpy(&value, words, sizeof(T));
+            return value;
+        }
+
+        // Increases with every store.
+        uint64_t version() const { return sequence_.load(std::memory_order_acquire) / 2; }
+
+    private:
+        typedef uint64_t word_type;
+        enum { word_count = (sizeof(T) + sizeof(word_type) - 1) / sizeof(word_type) };
+
+        std::atomic<uint64_t> sequence_{0};
+        std::atomic<word_type> words_[word_count];
+    };
+}
@@ -0,0 +1,104 @@
+#include "timesync.h"
+
+#include "log.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+using asio::ip::udp;
+using namespace std;
+
+namespace
+{
+    const char request_prefix[] = "TIME?";
+    const char reply_prefix[]   = "TIME!";
+    const size_t prefix_length  = 5;
+}
+
+namespace timesync
+{
+    int64_t now_us()
+    {
+        return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    string answer(const char* data, size_t size, int64_t received_us)
+    {
+        if (size <= prefix_length || size > 32 || memcmp(data, request_prefix, prefix_length) != 0)
+            return string();
+        char t1[32];
+        memcpy(t1, data + prefix_length, size - prefix_length);
+        t1[size - prefix_length] = '\0';
+        if (strspn(t1, "0123456789") != size - prefix_length)
+            return string();
+        char reply[96];
+        snprintf(reply, sizeof reply, "%s%s,%" PRId64 ",%" PRId64, reply_prefix, t1, received_us, now_us());
+        return reply;
+    }
+
+    clock_sync::clock_sync(asio::io_context& io_context, const udp::endpoint& reference)
+        : socket_(io_context, udp::endpoint(reference.protocol(), 0)), timer_(io_context), reference_(reference)
+    {
+    }
+
+    void clock_sync::start()
+    {
+        do_receive();
+        send_request();
+    }
+
+    void clock_sync::send_request()
+    {
+        pending_request_ = now_us();
+        auto request     = request_prefix + to_string(pending_request_);
+        asio::error_code ignored;
+        socket_.send_to(asio::buffer(request), reference_, 0, ignored);
+
+        timer_.expires_after(chrono::seconds(1));
+        timer_.async_wait([this](error_code ec) {
+            if (!ec)
+                send_request();
+        });
+    }
+
+    void clock_sync::do_receive()
+    {
+        socket_.async_receive_from(asio::buffer(buffer_), sender_, [this](error_code ec, size_t length) {
+            if (ec == asio::error::operation_aborted)
+                return;
+            if (!ec)
+                handle_reply(length, now_us());
+            do_receive();
+        });
+    }
+
+    void clock_sync::handle_reply(size_t length, int64_t received_us)
+    {
+        if (length <= prefix_length || length >= buffer_.size() || memcmp(buffer_.data(), reply_prefix, prefix_length))
+            return;
+        buffer_[length] = '\0';
+
+        // Only the reply to the latest request is used, late ones would have a long round trip anyway
+        int64_t t1, t2, t3;
+        if (sscanf(buffer_.data() + prefix_length, "%" SCNd64 ",%" SCNd64 ",%" SCNd64, &t1, &t2, &t3) != 3 ||
+            t1 != pending_request_)
+            return;
+        const int64_t t4 = received_us;
+
+        sample& s = samples_[next_sample_++ % sample_count];
+        s.delay_  = max<int64_t>((t4 - t1) - (t3 - t2), 0);
+        s.offset_ = ((t2 - t1) + (t3 - t4)) / 2;
+
+        const sample* best = nullptr;
+        for (const auto& candidate : samples_) {
+            if (candidate.delay_ >= 0 && (!best || candidate.delay_ < best->delay_))
+                best = &candidate;
+        }
+        if (!synchronized_)
+            logging::info("Clock synchronized to {}, offset {} us", reference_.address().to_string(), best->offset_);
+        synchronized_ = true;
+        offset_       = chrono::microseconds(best->offset_);
+        error_        = chrono::microseconds((best->delay_ + 1) / 2);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <asio.hpp>
+#include <asio/steady_timer.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace timesync
+{
+    // Local system clock in microseconds since the epoch.
+    int64_t now_us();
+
+    // NTP style exchange, answered on the discovery sockets and loopback of the reference daemon:
+    //   TIME?<t1>            t1 is the requester's send time
+    //   TIME!<t1>,<t2>,<t3>  t2 and t3 are the reference's receive and send times
+    // Returns the reply to a request received at `received_us`, or an empty string if
+    // `data` isn't a request.
+    std::string answer(const char* data, size_t size, int64_t received_us);
+
+    // Estimates the offset of the local system clock to the reference daemon's. A request is
+    // sent every second, and the sample with the shortest round trip of the last few is used,
+    // as its offset is least affected by queuing on the way.
+    struct clock_sync {
+        clock_sync(asio::io_context& io_context, const asio::ip::udp::endpoint& reference);
+
+        void start();
+
+        bool synchronized() const { return synchronized_; }
+        // Add to the local clock to get the reference's time.
+        std::chrono::microseconds offset() const { return offset_; }
+        // Largest possible error of offset(), half the round trip of its sample.
+        std::chrono::microseconds error() const { return error_; }
+
+    private:
+        struct sample {
+            int64_t offset_{};
+            int64_t delay_{-1};  // Negative if unused
+        };
+        enum { sample_count = 8 };
+
+        void send_request();
+        void do_receive();
+        void handle_reply(size_t length, int64_t received_us);
+
+        asio::ip::udp::socket socket_;
+        asio::steady_timer timer_;
+        asio::ip::udp::endpoint reference_;
+        asio::ip::udp::endpoint sender_;
+        std::array<char, 128> buffer_;
+        int64_t pending_request_{};
+        std::array<sample, sample_count> samples_;
+        size_t next_sample_{};
+        bool synchronized_{};
+        std::chrono::microseconds offset_{};
+        std::chrono::microseconds error_{};
+    };
+}
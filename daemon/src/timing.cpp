@@ -0,0 +1,89 @@
+#include "timing.h"
+
+#include <map>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+    struct wait {
+        asio::io_context* io_context_;
+        timing::timer::handler_type handler_;
+    };
+
+    bool simulated_ = false;
+    timing::clock::time_point virtual_now_{};
+    // Waits in virtual time by expiry, then in the order they were queued
+    map<pair<timing::clock::time_point, uint64_t>, wait> waits_;
+    uint64_t next_wait_ = 1;
+}
+
+namespace timing
+{
+    constexpr bool clock::is_steady;
+
+    clock::time_point clock::now()
+    {
+        if (simulated_)
+            return virtual_now_;
+        return time_point(chrono::steady_clock::now().time_since_epoch());
+    }
+
+    void simulate()
+    {
+        virtual_now_ = clock::now();
+        simulated_   = true;
+    }
+
+    bool simulated() { return simulated_; }
+
+    void timer::cancel()
+    {
+        if (!simulated_) {
+            timer_.cancel();
+            return;
+        }
+        auto it = waits_.find(make_pair(expiry_, wait_));
+        wait_   = 0;
+        if (it == waits_.end())
+            return;
+        auto handler = move(it->second.handler_);
+        waits_.erase(it);
+        asio::post(io_context_, [handler] { handler(asio::error::operation_aborted); });
+    }
+
+    void timer::expires_at(clock::time_point t)
+    {
+        if (!simulated_) {
+            timer_.expires_at(t);
+            return;
+        }
+        cancel();
+        expiry_ = t;
+    }
+
+    void timer::queue(handler_type handler)
+    {
+        cancel();
+        wait_ = next_wait_++;
+        waits_.emplace(make_pair(expiry_, wait_), wait{&io_context_, move(handler)});
+    }
+
+    void run_virtual(asio::io_context& io_context)
+    {
+        for (;;) {
+            io_context.restart();
+            io_context.poll();
+            if (waits_.empty())
+                break;
+            // Nothing left to do now, so the next wait is due
+            auto it = waits_.begin();
+            if (it->first.first > virtual_now_)
+                virtual_now_ = it->first.first;
+            auto w = move(it->second);
+            waits_.erase(it);
+            asio::post(*w.io_context_, [w] { w.handler_(asio::error_code()); });
+        }
+    }
+}
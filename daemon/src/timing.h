@@ -0,0 +1,67 @@
+#pragma once
+
+#include <asio.hpp>
+#include <asio/basic_waitable_timer.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace timing
+{
+    // The daemon's monotonic clock: the steady clock, or in simulation a virtual clock that
+    // only moves on when everything due has run, see run_virtual().
+    struct clock {
+        using duration   = std::chrono::steady_clock::duration;
+        using rep        = duration::rep;
+        using period     = duration::period;
+        using time_point = std::chrono::time_point<clock>;
+        static constexpr bool is_steady = true;
+
+        static time_point now();
+    };
+
+    // Switches the process to virtual time, starting at the steady time of the call. For
+    // simulation only, before any timer is waited on.
+    void simulate();
+    bool simulated();
+
+    // A timer on the clock, with the part of the asio::steady_timer interface the daemon uses.
+    // In virtual time the wait is queued on the virtual clock instead of the io_context, and
+    // only one wait at a time is supported.
+    struct timer {
+        typedef std::function<void(const asio::error_code&)> handler_type;
+
+        explicit timer(asio::io_context& io_context) : io_context_(io_context), timer_(io_context) {}
+        ~timer() { cancel(); }
+
+        // Cancels the wait, as a new expiry does. Its handler is called with operation_aborted.
+        void cancel();
+        void expires_at(clock::time_point t);
+        void expires_after(clock::duration d) { expires_at(clock::now() + d); }
+
+        template <typename Handler>
+        void async_wait(Handler&& handler)
+        {
+            if (simulated())
+                queue(handler_type(std::forward<Handler>(handler)));
+            else
+                timer_.async_wait(std::forward<Handler>(handler));
+        }
+
+    private:
+        timer(const timer&) = delete;
+        timer& operator=(const timer&) = delete;
+
+        void queue(handler_type handler);
+
+        asio::io_context& io_context_;
+        asio::basic_waitable_timer<clock> timer_;
+        clock::time_point expiry_{};
+        uint64_t wait_{};  // Key of the queued wait in virtual time, 0 if none
+    };
+
+    // Runs `io_context` in virtual time until it is out of work: handlers that are ready run,
+    // and when there are none the clock jumps to the earliest timer. Nothing waits in real
+    // time, so this runs as fast as the handlers do.
+    void run_virtual(asio::io_context& io_context);
+}
@@ -1,7 +1,44 @@
 #include "utility.h"
 
+#include <cstdlib>
+#include <thread>
+
+#ifndef _WIN32
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+extern char** environ;
+#endif
+
 using namespace std;
 
+#ifdef _WIN32
+void utility::spawn_detached(const string& cmdline)
+{
+    thread([cmdline] { system(cmdline.c_str()); }).detach();
+}
+#else
+void utility::spawn_detached(const string& cmdline)
+{
+    // Children are never waited upon, let the kernel reap them.
+    static const bool reaping = (signal(SIGCHLD, SIG_IGN) != SIG_ERR);
+    (void)reaping;
+
+    // A player must not inherit the real-time policy of the daemon
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sched_param param{};
+    posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER);
+    posix_spawnattr_setschedparam(&attr, &param);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSCHEDULER);
+
+    const char* argv[] = {"sh", "-c", cmdline.c_str(), nullptr};
+    pid_t pid;
+    posix_spawn(&pid, "/bin/sh", nullptr, &attr, const_cast<char**>(argv), environ);
+    posix_spawnattr_destroy(&attr);
+}
+#endif
+
 #ifndef __linux__
 vector<asio::ip::address> utility::get_interface_addresses()
 {
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <asio.hpp>
+#include <string>
 #include <vector>
 
 namespace utility
 {
     std::vector<asio::ip::address> get_interface_addresses();
+
+    // Runs `cmdline` through the shell without waiting for it to finish.
+    void spawn_detached(const std::string& cmdline);
 }